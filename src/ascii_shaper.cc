@@ -0,0 +1,159 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./ascii_shaper.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <harfbuzz/hb-ot.h>
+
+namespace ascii_shaper {
+
+// The features HarfBuzz applies by default to horizontal text, plus the
+// ones we ask for
+static const hb_tag_t kSubstitutionFeatures[] = {
+    HB_TAG('c', 'c', 'm', 'p'), HB_TAG('l', 'o', 'c', 'l'),
+    HB_TAG('r', 'l', 'i', 'g'), HB_TAG('r', 'c', 'l', 't'),
+    HB_TAG('c', 'a', 'l', 't'), HB_TAG('c', 'l', 'i', 'g'),
+    HB_TAG('l', 'i', 'g', 'a'), HB_TAG('r', 'v', 'r', 'n'),
+    HB_TAG_NONE};
+static const hb_tag_t kPositioningFeatures[] = {
+    HB_TAG('k', 'e', 'r', 'n'), HB_TAG('m', 'a', 'r', 'k'),
+    HB_TAG('m', 'k', 'm', 'k'), HB_TAG('c', 'u', 'r', 's'),
+    HB_TAG('d', 'i', 's', 't'), HB_TAG('a', 'b', 'v', 'm'),
+    HB_TAG('b', 'l', 'w', 'm'), HB_TAG_NONE};
+
+// Adds to glyphs the input glyphs of the lookups of the features in table
+static void CollectInputGlyphs(hb_face_t *face, hb_tag_t table,
+                               const hb_tag_t *features, hb_set_t *glyphs) {
+  hb_set_t *lookups = hb_set_create();
+  hb_ot_layout_collect_lookups(face, table, nullptr, nullptr, features,
+                               lookups);
+
+  hb_codepoint_t lookup = HB_SET_VALUE_INVALID;
+  while (hb_set_next(lookups, &lookup)) {
+    hb_ot_layout_lookup_collect_glyphs(face, table, lookup, nullptr, glyphs,
+                                       nullptr, nullptr);
+  }
+  hb_set_destroy(lookups);
+}
+
+AsciiShaper::AsciiShaper() {
+  glyphs_.fill(0);
+  advances_.fill(0);
+  triggers_.fill(true);
+  low_nibbles_.fill(0);
+  high_nibbles_.fill(0);
+}
+
+void AsciiShaper::Load(hb_font_t *font, FT_Face face) {
+  // Emoji are scaled bitmaps, not worth it
+  if (FT_HAS_COLOR(face)) return;
+
+  hb_set_t *input_glyphs = hb_set_create();
+  hb_face_t *hb_face = hb_font_get_face(font);
+  CollectInputGlyphs(hb_face, HB_OT_TAG_GSUB, kSubstitutionFeatures,
+                     input_glyphs);
+  CollectInputGlyphs(hb_face, HB_OT_TAG_GPOS, kPositioningFeatures,
+                     input_glyphs);
+
+  for (hb_codepoint_t c = ' '; c < 0x7F; c++) {
+    hb_codepoint_t glyph;
+    if (!hb_font_get_nominal_glyph(font, c, &glyph)) {
+      hb_set_destroy(input_glyphs);
+      return;
+    }
+    glyphs_[c] = glyph;
+    advances_[c] = hb_font_get_glyph_h_advance(font, glyph) >> 6;
+    triggers_[c] = hb_set_has(input_glyphs, glyph);
+  }
+  hb_set_destroy(input_glyphs);
+
+  // Characters are split in a high nibble, 0 to 7, and a low one. The high
+  // nibble table has a bit for each of them, the low nibble table has the
+  // bits of the high nibbles which make a trigger with it
+  for (unsigned int high = 0; high < 8; high++) {
+    high_nibbles_[high] = 1 << high;
+  }
+  for (unsigned int c = 0; c < 128; c++) {
+    if (triggers_[c]) low_nibbles_[c & 0x0F] |= 1 << (c >> 4);
+  }
+
+  enabled_ = true;
+}
+
+#if defined(__SSE2__)
+// Returns true as soon as a block of 16 bytes has a trigger or a byte which
+// is not ASCII. Sets `*scanned` to how many bytes were cleared
+__attribute__((target("ssse3"))) static bool HasTriggersSSSE3(
+    const char *data, size_t size, const uint8_t *low_nibbles,
+    const uint8_t *high_nibbles, size_t *scanned) {
+  const __m128i low_table =
+      _mm_load_si128(reinterpret_cast<const __m128i *>(low_nibbles));
+  const __m128i high_table =
+      _mm_load_si128(reinterpret_cast<const __m128i *>(high_nibbles));
+  const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+  const __m128i zero = _mm_setzero_si128();
+
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    // Bytes with the high bit set
+    if (_mm_movemask_epi8(bytes) != 0) {
+      *scanned = i;
+      return true;
+    }
+
+    __m128i low = _mm_and_si128(bytes, nibble_mask);
+    __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble_mask);
+    __m128i classes = _mm_and_si128(_mm_shuffle_epi8(low_table, low),
+                                    _mm_shuffle_epi8(high_table, high));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(classes, zero)) != 0xFFFF) {
+      *scanned = i;
+      return true;
+    }
+  }
+  *scanned = i;
+  return false;
+}
+#endif
+
+bool AsciiShaper::NeedsHarfBuzz(string_view text) const {
+  size_t scanned = 0;
+#if defined(__SSE2__)
+  static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+  if (has_ssse3 &&
+      HasTriggersSSSE3(text.data(), text.size(), low_nibbles_.data(),
+                       high_nibbles_.data(), &scanned)) {
+    return true;
+  }
+#endif
+  // Whatever is left over from the vectorized loop
+  for (size_t i = scanned; i < text.size(); i++) {
+    auto c = static_cast<unsigned char>(text[i]);
+    if (c >= 0x80 || triggers_[c]) return true;
+  }
+  return false;
+}
+
+bool AsciiShaper::Shape(string_view text, size_t face_index,
+                        ShapedText *shaped_text) const {
+  if (!enabled_ || NeedsHarfBuzz(text)) return false;
+
+  shaped_text->faces.assign(text.size(), face_index);
+  shaped_text->codepoints.resize(text.size());
+  shaped_text->advances.resize(text.size());
+  shaped_text->clusters.resize(text.size());
+  // Nothing applies across characters, so the text can be split anywhere
+  shaped_text->unsafe_to_break.assign(text.size(), 0);
+  for (size_t i = 0; i < text.size(); i++) {
+    auto c = static_cast<unsigned char>(text[i]);
+    shaped_text->codepoints[i] = glyphs_[c];
+    shaped_text->advances[i] = advances_[c];
+    shaped_text->clusters[i] = i;
+  }
+  return true;
+}
+
+}  // namespace ascii_shaper
@@ -0,0 +1,58 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_ASCII_SHAPER_H_
+#define SRC_ASCII_SHAPER_H_
+
+#include <harfbuzz/hb.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include "./shaping_cache.h"
+
+namespace ascii_shaper {
+using shaping_cache::ShapedText;
+using std::array;
+using std::string_view;
+
+// Shapes plain ASCII text without HarfBuzz, by looking glyphs and advances up
+// in a table. That is only what HarfBuzz would do if no substitution or
+// positioning of the face applies to the text, so the characters whose
+// glyphs are the input of any of the face's default GSUB and GPOS lookups
+// (ligatures, contextual alternates, kerning...) are triggers which send the
+// text to HarfBuzz, as are control characters and anything but ASCII.
+class AsciiShaper {
+ public:
+  // Disabled until a face is loaded
+  AsciiShaper();
+
+  // Build the tables for the font. Color faces and faces missing some
+  // printable ASCII glyph leave the shaper disabled
+  void Load(hb_font_t *font, FT_Face face);
+
+  // Returns false, leaving shaped_text untouched, if the text has to be
+  // shaped by HarfBuzz
+  bool Shape(string_view text, size_t face_index,
+             ShapedText *shaped_text) const;
+
+ private:
+  bool enabled_ = false;
+  array<hb_codepoint_t, 128> glyphs_;
+  array<int, 128> advances_;
+  array<bool, 128> triggers_;
+
+  // The triggers as two 16-entry tables indexed by the low and the high
+  // nibble of a character, whose entries have a common bit only for
+  // triggers. So that a vector shuffle can classify 16 bytes at once
+  alignas(16) array<uint8_t, 16> low_nibbles_;
+  alignas(16) array<uint8_t, 16> high_nibbles_;
+
+  bool NeedsHarfBuzz(string_view text) const;
+};
+
+}  // namespace ascii_shaper
+
+#endif  // SRC_ASCII_SHAPER_H_
@@ -6,43 +6,209 @@
 
 #include <GLFW/glfw3.h>
 
-#include <string>
-#include <vector>
-
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/mat4x4.hpp>
 
+#include <string>
+#include <string_view>
+
+#include "./document.h"
+#include "./editor.h"
+#include "./search.h"
 #include "./state.h"
+#include "./wrap_index.h"
 
 #define UNUSED __attribute__((unused))
 
 namespace callbacks {
-using std::string;
-using std::vector;
 typedef struct {
   GLuint shader_program_id;
-  const vector<string> *lines;
+  const document::Document *document;
   state::State *state;
+  wrap_index::WrapIndex *wrap_index;
+  editor::Editor *editor;
+  // The key which starts insert mode also comes as a character, which must
+  // not be typed in
+  bool ignore_next_char;
+  search::Search *search;
+  // While the query is typed in
+  bool finding;
+  // Scroll to the next (1) or the previous (-1) match once it's found, from
+  // the current match if there is one or else from the top of the screen
+  int jump;
+  // The match jumped to last
+  bool has_current_match;
+  search::match_t current_match;
 } glfw_user_pointer_t;
 
+// Returns how many bytes of text the codepoint took
+static size_t EncodeUTF8(unsigned int codepoint, char text[4]) {
+  if (codepoint < 0x80) {
+    text[0] = codepoint;
+    return 1;
+  } else if (codepoint < 0x800) {
+    text[0] = 0xC0 | (codepoint >> 6);
+    text[1] = 0x80 | (codepoint & 0x3F);
+    return 2;
+  } else if (codepoint < 0x10000) {
+    text[0] = 0xE0 | (codepoint >> 12);
+    text[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+    text[2] = 0x80 | (codepoint & 0x3F);
+    return 3;
+  }
+  text[0] = 0xF0 | (codepoint >> 18);
+  text[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+  text[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+  text[3] = 0x80 | (codepoint & 0x3F);
+  return 4;
+}
+
+// Search for the new query from the top of the screen, matches show up while
+// it's being typed
+static void UpdateQuery(glfw_user_pointer_t *obj, const std::string &query,
+                        bool is_regex) {
+  obj->search->Start(query, is_regex, obj->state->GetStartLine());
+  obj->jump = query.empty() ? 0 : 1;
+  obj->has_current_match = false;
+}
+
+// Keys while the query is typed in
+static void FindModeKeyCallback(glfw_user_pointer_t *obj, int key,
+                                int mods) {
+  std::string query = obj->search->GetQuery();
+  bool is_regex = obj->search->IsRegex();
+  switch (key) {
+    case GLFW_KEY_ESCAPE:
+      obj->finding = false;
+      obj->jump = 0;
+      obj->search->Clear();
+      break;
+    case GLFW_KEY_R:
+      // Toggle between plain text and regular expressions
+      if (mods & GLFW_MOD_CONTROL) {
+        UpdateQuery(obj, query, !is_regex);
+      }
+      break;
+    case GLFW_KEY_ENTER:
+    case GLFW_KEY_KP_ENTER:
+      // The matches stay
+      obj->finding = false;
+      break;
+    case GLFW_KEY_BACKSPACE:
+      // Remove the last codepoint
+      while (!query.empty() &&
+             (static_cast<unsigned char>(query.back()) & 0xC0) == 0x80) {
+        query.pop_back();
+      }
+      if (!query.empty()) query.pop_back();
+      UpdateQuery(obj, query, is_regex);
+      break;
+  }
+}
+
+// Keys while in insert mode, where letters are typed in instead of being
+// commands
+static void InsertModeKeyCallback(glfw_user_pointer_t *obj, int key) {
+  auto editor = obj->editor;
+  switch (key) {
+    case GLFW_KEY_ESCAPE:
+      editor->StopInserting();
+      break;
+    case GLFW_KEY_ENTER:
+    case GLFW_KEY_KP_ENTER:
+      editor->InsertNewline();
+      break;
+    case GLFW_KEY_TAB:
+      editor->Insert("\t");
+      break;
+    case GLFW_KEY_BACKSPACE:
+      editor->DeleteBackward();
+      break;
+    case GLFW_KEY_DELETE:
+      editor->DeleteForward();
+      break;
+    case GLFW_KEY_LEFT:
+      editor->MoveLeft();
+      break;
+    case GLFW_KEY_RIGHT:
+      editor->MoveRight();
+      break;
+    case GLFW_KEY_UP:
+      editor->MoveUp();
+      break;
+    case GLFW_KEY_DOWN:
+      editor->MoveDown();
+      break;
+    case GLFW_KEY_HOME:
+      editor->MoveToLineStart();
+      break;
+    case GLFW_KEY_END:
+      editor->MoveToLineEnd();
+      break;
+  }
+}
+
 void KeyCallback(GLFWwindow *window, int key, int scancode UNUSED, int action,
-                 int mods UNUSED) {
+                 int mods) {
   auto obj =
       static_cast<glfw_user_pointer_t *>(glfwGetWindowUserPointer(window));
   auto state = obj->state;
-  auto lines = obj->lines;
+  auto document = obj->document;
+
+  // Save the edits, in any mode. The document stays as it is, so the search
+  // goes on, and the trigram index starts over once it's not modified
+  if (key == GLFW_KEY_S && (mods & GLFW_MOD_CONTROL) && action == GLFW_PRESS) {
+    obj->editor->Save();
+    return;
+  }
+  if (obj->finding) {
+    if (action == GLFW_PRESS || action == GLFW_REPEAT) {
+      FindModeKeyCallback(obj, key, mods);
+    }
+    return;
+  }
+  if (obj->editor->IsInserting()) {
+    if (action == GLFW_PRESS || action == GLFW_REPEAT) {
+      InsertModeKeyCallback(obj, key);
+    }
+    return;
+  }
+  // Type in a new query
+  if (key == GLFW_KEY_F && (mods & GLFW_MOD_CONTROL) && action == GLFW_PRESS) {
+    obj->finding = true;
+    UpdateQuery(obj, std::string(), obj->search->IsRegex());
+    return;
+  }
+  // Go through the matches
+  if (((key == GLFW_KEY_N && !(mods & GLFW_MOD_CONTROL)) ||
+       key == GLFW_KEY_F3) &&
+      (action == GLFW_PRESS || action == GLFW_REPEAT) &&
+      obj->search->IsActive()) {
+    obj->jump = (mods & GLFW_MOD_SHIFT) ? -1 : 1;
+    return;
+  }
+  // Start editing at the top of the screen
+  if (key == GLFW_KEY_I && mods == 0 && action == GLFW_PRESS) {
+    obj->ignore_next_char = obj->editor->StartInserting(state->GetStartLine());
+    return;
+  }
+
   if ((key == GLFW_KEY_DOWN || key == GLFW_KEY_J) &&
       (action == GLFW_PRESS || action == GLFW_REPEAT)) {
-    if ((state->GetStartLine() + state->GetVisibleLines() + 1) <=
-        lines->size()) {
+    if (state->IsWrapping()) {
+      state->ScrollRows(1, *obj->wrap_index);
+    } else if (document->HasLines(state->GetStartLine() +
+                                  state->GetVisibleLines() + 1)) {
       state->GoUp(1);
     }
   }
   if ((key == GLFW_KEY_UP || key == GLFW_KEY_K) &&
       (action == GLFW_PRESS || action == GLFW_REPEAT)) {
     // TODO(andrea): move this logic into the state instead
-    if ((state->GetStartLine() - 1) >= 0) {
+    if (state->IsWrapping()) {
+      state->ScrollRows(-1, *obj->wrap_index);
+    } else if ((state->GetStartLine() - 1) >= 0) {
       state->GoDown(1);
     }
   }
@@ -54,26 +220,66 @@ void KeyCallback(GLFWwindow *window, int key, int scancode UNUSED, int action,
     state->GotoBeginning();
   }
   if ((key == GLFW_KEY_END) && action == GLFW_PRESS) {
-    state->GotoEnd(lines->size());
+    // While the document is being indexed this is the end of the lines
+    // indexed so far
+    if (state->IsWrapping()) {
+      state->GotoLastRow(*obj->wrap_index);
+    } else {
+      state->GotoEnd(document->LineCount());
+    }
+  }
+
+  // Toggle soft wrapping, lines are measured as they get close to the screen
+  if (key == GLFW_KEY_Z && (mods & GLFW_MOD_ALT) && action == GLFW_PRESS) {
+    state->ToggleWrapping();
+    if (state->IsWrapping()) {
+      obj->wrap_index->Reset(document->LineCount());
+    } else {
+      obj->wrap_index->Clear();
+    }
   }
 }
 
+void CharCallback(GLFWwindow *window, unsigned int codepoint) {
+  auto obj =
+      static_cast<glfw_user_pointer_t *>(glfwGetWindowUserPointer(window));
+  if (obj->ignore_next_char) {
+    obj->ignore_next_char = false;
+    return;
+  }
+  char text[4];
+  size_t length = EncodeUTF8(codepoint, text);
+  if (obj->finding) {
+    UpdateQuery(obj, obj->search->GetQuery() + std::string(text, length),
+                obj->search->IsRegex());
+    return;
+  }
+  if (!obj->editor->IsInserting()) return;
+
+  obj->editor->Insert(std::string_view(text, length));
+}
+
 void ScrollCallback(GLFWwindow *window, double xoffset UNUSED, double yoffset) {
   int lines_to_scroll = yoffset;
 
   glfw_user_pointer_t *obj =
       static_cast<glfw_user_pointer_t *>(glfwGetWindowUserPointer(window));
-  auto lines = obj->lines;
+  auto document = obj->document;
 
   auto state = obj->state;
+  if (state->IsWrapping()) {
+    state->ScrollRows(-lines_to_scroll, *obj->wrap_index);
+    return;
+  }
+
   if (yoffset > 0) {  // going up
     if ((state->GetStartLine() - lines_to_scroll) >= 0) {
       state->GoDown(lines_to_scroll);
     }
   } else {  // going down
     lines_to_scroll = -lines_to_scroll;
-    if ((state->GetStartLine() + state->GetVisibleLines() + lines_to_scroll) <=
-        lines->size()) {
+    if (document->HasLines(state->GetStartLine() + state->GetVisibleLines() +
+                           lines_to_scroll)) {
       state->GoUp(lines_to_scroll);
     }
   }
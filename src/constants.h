@@ -2,6 +2,8 @@
 #ifndef SRC_CONSTANTS_H_
 #define SRC_CONSTANTS_H_
 
+#include <cstddef>
+
 static const unsigned int kInitialLine = 0;
 static const unsigned int kInitialWindowWidth = 1024;
 static const unsigned int kInitialWindowHeight = 768;
@@ -10,9 +12,31 @@ static const unsigned int kFontPixelWidth = kFontPixelHeight - 1;
 static const unsigned int kLineHeight =
     static_cast<int>(kFontPixelHeight * 1.35);  // Copied from VSCode's code
 static const char kWindowTitle[] = "OpenGL";
+// Lines longer than this many bytes are shaped in chunks, about a couple of
+// screens wide
+static const unsigned int kShapingChunkSize = 512;
+// How much memory the shaping cache can use for lines, in bytes
+static const size_t kShapingCacheBudget = 64 << 20;
+// And on top of that for the words lines are made of
+static const size_t kShapedRunsCacheBudget = 16 << 20;
+// The memory frames start with for their temporaries, the arena grows to what
+// they actually need
+static const size_t kFrameArenaSize = 1 << 20;
+// How much memory the trigram index of a file can use, its blocks of lines
+// get bigger to fit
+static const size_t kTrigramIndexBudget = 256 << 20;
 
 // Dark+
 #define FOREGROUND_COLOR 220. / 255, 218. / 255, 172. / 255, 1.0f
 #define BACKGROUND_COLOR 35. / 255, 35. / 255, 35. / 255, 1.0f
+// Of the tokens of code, see highlighter
+#define KEYWORD_COLOR 86. / 255, 156. / 255, 214. / 255, 1.0f
+#define TYPE_COLOR 78. / 255, 201. / 255, 176. / 255, 1.0f
+#define COMMENT_COLOR 106. / 255, 153. / 255, 85. / 255, 1.0f
+#define STRING_COLOR 206. / 255, 145. / 255, 120. / 255, 1.0f
+#define NUMBER_COLOR 181. / 255, 206. / 255, 168. / 255, 1.0f
+#define PREPROCESSOR_COLOR 197. / 255, 134. / 255, 192. / 255, 1.0f
+// Behind the line with the caret
+#define CURRENT_LINE_COLOR 48. / 255, 48. / 255, 48. / 255, 1.0f
 
 #endif  // SRC_CONSTANTS_H_
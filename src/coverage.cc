@@ -0,0 +1,59 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./coverage.h"
+
+#include <cassert>
+
+namespace coverage {
+
+static const hb_codepoint_t kCodepoints = 0x110000;
+static const hb_codepoint_t kBmpCodepoints = 0x10000;
+static const unsigned int kBlockBits = 8;
+static const hb_codepoint_t kBlockSize = 1 << kBlockBits;
+
+FaceCoverage::FaceCoverage()
+    : bmp_faces_(kBmpCodepoints, kNoFace),
+      astral_index_((kCodepoints - kBmpCodepoints) >> kBlockBits, 0),
+      astral_blocks_(1) {
+  astral_blocks_[0].fill(kNoFace);
+}
+
+void FaceCoverage::AddFace(FT_Face face) {
+  assert(faces_ < kNoFace);
+  uint8_t face_index = faces_++;
+
+  // Walk the face's charmap, which is the Unicode one unless the face has
+  // none
+  FT_UInt glyph_index;
+  FT_ULong codepoint = FT_Get_First_Char(face, &glyph_index);
+  for (; glyph_index != 0;
+       codepoint = FT_Get_Next_Char(face, codepoint, &glyph_index)) {
+    if (codepoint >= kCodepoints) break;
+    SetFace(codepoint, face_index);
+  }
+}
+
+void FaceCoverage::SetFace(hb_codepoint_t codepoint, uint8_t face) {
+  if (codepoint < kBmpCodepoints) {
+    if (bmp_faces_[codepoint] == kNoFace) bmp_faces_[codepoint] = face;
+    return;
+  }
+
+  uint16_t &block = astral_index_[(codepoint - kBmpCodepoints) >> kBlockBits];
+  if (block == 0) {
+    block = astral_blocks_.size();
+    astral_blocks_.emplace_back();
+    astral_blocks_.back().fill(kNoFace);
+  }
+  uint8_t &entry = astral_blocks_[block][codepoint & (kBlockSize - 1)];
+  if (entry == kNoFace) entry = face;
+}
+
+uint8_t FaceCoverage::FaceFor(hb_codepoint_t codepoint) const {
+  if (codepoint < kBmpCodepoints) return bmp_faces_[codepoint];
+  if (codepoint >= kCodepoints) return kNoFace;
+
+  uint16_t block = astral_index_[(codepoint - kBmpCodepoints) >> kBlockBits];
+  return astral_blocks_[block][codepoint & (kBlockSize - 1)];
+}
+
+}  // namespace coverage
@@ -0,0 +1,50 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_COVERAGE_H_
+#define SRC_COVERAGE_H_
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <harfbuzz/hb.h>
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace coverage {
+using std::array;
+using std::vector;
+
+// Which face to render each codepoint with, read from the cmaps of the faces
+// when they are loaded. It's a table of the first face which has each
+// codepoint, direct for the BMP and two-level for the other planes, which are
+// mostly empty: a block for each 256 codepoints that any face has, all the
+// others share an empty one. It answers in O(1) without touching the fonts.
+class FaceCoverage {
+ public:
+  static constexpr uint8_t kNoFace = 0xFF;
+
+  FaceCoverage();
+
+  // Faces are added in order of preference
+  void AddFace(FT_Face face);
+
+  // Returns the first face which has the codepoint, or kNoFace
+  uint8_t FaceFor(hb_codepoint_t codepoint) const;
+
+ private:
+  typedef array<uint8_t, 256> face_block_t;
+
+  uint8_t faces_ = 0;
+  vector<uint8_t> bmp_faces_;
+  // For each 256 codepoints their block, 0 is the one where no face has any
+  // codepoint
+  vector<uint16_t> astral_index_;
+  vector<face_block_t> astral_blocks_;
+
+  void SetFace(hb_codepoint_t codepoint, uint8_t face);
+};
+
+}  // namespace coverage
+
+#endif  // SRC_COVERAGE_H_
@@ -0,0 +1,582 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./document.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#include "./gzip_index.h"
+#include "./hash.h"
+#include "./line_indexer.h"
+
+namespace document {
+using gzip_index::GzipIndex;
+using line_indexer::FindLineStarts;
+using line_indexer::FindLineStartsParallel;
+using std::lock_guard;
+using std::unique_lock;
+
+// The first step is small so that the first screen is ready right away, the
+// following ones are big enough to keep all of the cores busy
+static const size_t kFirstIndexingStep = 64 << 10;
+static const size_t kIndexingStep = 64 << 20;
+// Lines per page of remembered line hashes
+static const size_t kLineHashPageSize = 4096;
+// Hashes of edited lines are forgotten when there are more than this many
+static const size_t kMaxEditedLineHashes = 64 << 10;
+static const unsigned char kGzipMagic[] = {0x1f, 0x8b};
+
+// Drop the line terminator at the end of the text, if there is one
+static string_view TrimTerminator(string_view text) {
+  size_t length = text.size();
+  if (length > 0 && text[length - 1] == '\n') length--;
+  if (length > 0 && text[length - 1] == '\r') length--;
+  return text.substr(0, length);
+}
+
+Document::Document(const string &path, function<void()> on_progress)
+    : path_(path), on_progress_(on_progress) {
+  if (!Open()) {
+    fprintf(stderr, "Could not open file: %s\n", path_.c_str());
+    exit(EXIT_FAILURE);
+  }
+}
+
+Document::~Document() { Close(); }
+
+bool Document::Open() {
+  int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    close(fd);
+    return false;
+  }
+
+  // The file which was open until now is only let go once the new one is
+  if (fd_ != -1) {
+    Close();
+  }
+  fd_ = fd;
+  device_ = file_stat.st_dev;
+  inode_ = file_stat.st_ino;
+  size_ = file_stat.st_size;
+
+  Map();
+
+  // Compressed files are recognized by their magic number, not their name
+  if (size_ >= 2 && static_cast<unsigned char>(data_[0]) == kGzipMagic[0] &&
+      static_cast<unsigned char>(data_[1]) == kGzipMagic[1]) {
+    gzip_index_.reset(
+        new GzipIndex(reinterpret_cast<const unsigned char *>(data_), size_));
+  } else {
+    text_size_ = size_;
+    if (size_ > 0) {
+      line_starts_.push_back(0);
+    }
+  }
+
+  indexing_thread_ = thread(&Document::Index, this);
+  return true;
+}
+
+void Document::Close() {
+  stop_indexing_ = true;
+  if (indexing_thread_.joinable()) {
+    indexing_thread_.join();
+  }
+  stop_indexing_ = false;
+
+  gzip_index_.reset();
+  if (data_ != nullptr) {
+    munmap(const_cast<char *>(data_), size_);
+    data_ = nullptr;
+  }
+  close(fd_);
+  fd_ = -1;
+
+  line_starts_.clear();
+  line_hash_pages_.clear();
+  pieces_.Reset(string_view(), nullptr);
+  edited_ = false;
+  modified_ = false;
+  joined_lines_.clear();
+  joined_by_line_.clear();
+  edited_line_hashes_.clear();
+  revision_++;
+  text_size_ = 0;
+  indexed_bytes_ = 0;
+  indexed_ = false;
+}
+
+void Document::Map() {
+  // mmap fails on empty files, an empty document just has no lines
+  if (size_ == 0) return;
+
+  void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Could not mmap file: %s\n", path_.c_str());
+    exit(EXIT_FAILURE);
+  }
+  data_ = static_cast<const char *>(data);
+}
+
+void Document::Index() {
+  if (gzip_index_) {
+    IndexCompressed();
+  } else {
+    IndexPlain();
+  }
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    // A newline at the very end of the file doesn't start a new line, just
+    // like with std::getline
+    if (!line_starts_.empty() && line_starts_.back() == text_size_) {
+      line_starts_.pop_back();
+    }
+    indexed_ = !stop_indexing_;
+  }
+  lines_indexed_.notify_all();
+
+  if (on_progress_) on_progress_();
+}
+
+void Document::IndexPlain() {
+  size_t step = kFirstIndexingStep;
+  vector<size_t> new_line_starts;
+
+  while (indexed_bytes_ < size_ && !stop_indexing_) {
+    size_t begin = indexed_bytes_;
+    size_t end = std::min(begin + step, size_);
+    step = kIndexingStep;
+
+    // Scan without holding the lock, readers only see complete steps
+    new_line_starts.clear();
+    FindLineStartsParallel(data_ + begin, end - begin, begin,
+                           &new_line_starts);
+
+    {
+      lock_guard<mutex> lock(mutex_);
+      line_starts_.insert(line_starts_.end(), new_line_starts.begin(),
+                          new_line_starts.end());
+      indexed_bytes_ = end;
+    }
+    lines_indexed_.notify_all();
+
+    if (on_progress_) on_progress_();
+  }
+}
+
+void Document::IndexCompressed() {
+  size_t step = kFirstIndexingStep;
+  vector<size_t> new_line_starts;
+  size_t new_text_size = 0;
+
+  // Lines are published in steps, like for plain files, although inflate
+  // hands out the text in much smaller pieces
+  auto publish = [&](size_t consumed) {
+    {
+      lock_guard<mutex> lock(mutex_);
+      line_starts_.insert(line_starts_.end(), new_line_starts.begin(),
+                          new_line_starts.end());
+      text_size_ = new_text_size;
+      indexed_bytes_ = consumed;
+    }
+    new_line_starts.clear();
+    lines_indexed_.notify_all();
+
+    if (on_progress_) on_progress_();
+  };
+
+  gzip_index_->Build([&](const char *text, size_t length, size_t offset,
+                         size_t consumed) {
+    if (offset == 0) {
+      new_line_starts.push_back(0);
+    }
+    FindLineStarts(text, length, offset, &new_line_starts);
+    new_text_size = offset + length;
+
+    if (new_text_size - text_size_ >= step) {
+      step = kIndexingStep;
+      publish(consumed);
+    }
+    return !stop_indexing_;
+  });
+
+  publish(size_);
+}
+
+void Document::IndexAppended(size_t old_size) {
+  vector<size_t> new_line_starts;
+
+  // The newline which used to end the file now starts a new line
+  if (old_size == 0 || data_[old_size - 1] == '\n') {
+    new_line_starts.push_back(old_size);
+  }
+  FindLineStarts(data_ + old_size, size_ - old_size, old_size,
+                 &new_line_starts);
+  // Bytes appended to the last line, without a newline, start no line
+  if (!new_line_starts.empty() && new_line_starts.back() == size_) {
+    new_line_starts.pop_back();
+  }
+
+  lock_guard<mutex> lock(mutex_);
+  // The last line might have been continued
+  if (!line_starts_.empty()) {
+    size_t last_line = line_starts_.size() - 1;
+    size_t page = last_line / kLineHashPageSize;
+    if (page < line_hash_pages_.size() && line_hash_pages_[page]) {
+      line_hash_pages_[page][last_line % kLineHashPageSize] = 0;
+    }
+  }
+  line_starts_.insert(line_starts_.end(), new_line_starts.begin(),
+                      new_line_starts.end());
+  text_size_ = size_;
+  indexed_bytes_ = size_;
+}
+
+bool Document::Refresh() {
+  // Edits refer to lines of the file as it was when they were made
+  if (!IsIndexed() || modified_) return false;
+
+  // While a file is being rotated there might be no file with its name for a
+  // moment, keep showing the old one until the new one shows up
+  struct stat file_stat;
+  if (stat(path_.c_str(), &file_stat) == -1) return true;
+
+  // The edits are on top of the file which was opened. Once saved they are
+  // what the file looks like, until someone else changes it
+  if (edited_) {
+    if (file_stat.st_dev == saved_device_ &&
+        file_stat.st_ino == saved_inode_ && file_stat.st_size == saved_size_) {
+      return true;
+    }
+    return Open();
+  }
+
+  bool replaced =
+      file_stat.st_dev != device_ || file_stat.st_ino != inode_;
+
+  size_t new_size = file_stat.st_size;
+  if (replaced || new_size < size_ ||
+      (gzip_index_ && new_size != size_)) {
+    // Rotated, truncated or a compressed file which changed, so there's
+    // nothing we can keep. If the file went away in the meantime the old
+    // one is kept until the next time
+    return Open();
+  } else if (new_size > size_) {
+    // Appended to, only the new bytes need to be indexed
+    size_t old_size = size_;
+    {
+      lock_guard<mutex> lock(mutex_);
+      if (data_ != nullptr) {
+        munmap(const_cast<char *>(data_), size_);
+      }
+      size_ = new_size;
+      Map();
+    }
+    IndexAppended(old_size);
+  }
+
+  return true;
+}
+
+size_t Document::IndexedLineCount() const {
+  if (edited_) {
+    return pieces_.LineCount();
+  }
+  // Until the file is fully indexed the last line might continue in the part
+  // which hasn't been scanned yet
+  if (!indexed_ && !line_starts_.empty()) {
+    return line_starts_.size() - 1;
+  }
+  return line_starts_.size();
+}
+
+bool Document::HasLines(size_t count) const {
+  lock_guard<mutex> lock(mutex_);
+  return IndexedLineCount() >= count;
+}
+
+size_t Document::LineCount() const {
+  lock_guard<mutex> lock(mutex_);
+  return IndexedLineCount();
+}
+
+uint64_t Document::GetLineHash(size_t line) const {
+  {
+    lock_guard<mutex> lock(mutex_);
+    // Lines which are still as in the file are remembered by their line in
+    // it, the others by their text
+    if (edited_) {
+      string_view text = GetEditedLine(line);
+      if (!FindIndexedLine(text, &line)) return GetEditedLineHash(text);
+    }
+  }
+  return GetIndexedLineHash(line);
+}
+
+uint64_t Document::GetEditedLineHash(string_view text) const {
+  auto it = edited_line_hashes_.find(text.data());
+  if (it != edited_line_hashes_.end() && it->second.length == text.size()) {
+    return it->second.hash;
+  }
+
+  uint64_t line_hash = hash::Hash(text);
+  if (line_hash == 0) line_hash = 1;
+
+  if (edited_line_hashes_.size() >= kMaxEditedLineHashes) {
+    edited_line_hashes_.clear();
+  }
+  edited_line_hashes_[text.data()] = text_hash_t{text.size(), line_hash};
+  return line_hash;
+}
+
+bool Document::FindIndexedLine(string_view text, size_t *line) const {
+  if (text.data() < data_ || text.data() >= data_ + text_size_) return false;
+
+  size_t start = text.data() - data_;
+  auto it = std::lower_bound(line_starts_.begin(), line_starts_.end(), start);
+  if (it == line_starts_.end() || *it != start) return false;
+
+  size_t indexed_line = it - line_starts_.begin();
+  if (GetIndexedLine(indexed_line).size() != text.size()) return false;
+  *line = indexed_line;
+  return true;
+}
+
+uint64_t Document::GetIndexedLineHash(size_t line) const {
+  size_t page = line / kLineHashPageSize, offset = line % kLineHashPageSize;
+  string_view text;
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (page < line_hash_pages_.size() && line_hash_pages_[page] &&
+        line_hash_pages_[page][offset] != 0) {
+      return line_hash_pages_[page][offset];
+    }
+    text = GetIndexedLine(line);
+  }
+
+  uint64_t line_hash = hash::Hash(text);
+  // 0 is taken to mean not computed yet
+  if (line_hash == 0) line_hash = 1;
+
+  lock_guard<mutex> lock(mutex_);
+  if (page >= line_hash_pages_.size()) {
+    line_hash_pages_.resize(page + 1);
+  }
+  if (!line_hash_pages_[page]) {
+    line_hash_pages_[page].reset(new uint64_t[kLineHashPageSize]());
+  }
+  line_hash_pages_[page][offset] = line_hash;
+  return line_hash;
+}
+
+string_view Document::GetLine(size_t line) const {
+  lock_guard<mutex> lock(mutex_);
+  return LookUpLine(line);
+}
+
+string_view Document::LookUpLine(size_t line) const {
+  assert(line < IndexedLineCount());
+
+  if (edited_) return GetEditedLine(line);
+  return GetIndexedLine(line);
+}
+
+string_view Document::GetEditedLine(size_t line) const {
+  auto joined = joined_by_line_.find(line);
+  if (joined != joined_by_line_.end()) return joined->second->text;
+
+  size_t start = pieces_.LineStart(line);
+  size_t end = line + 1 < pieces_.LineCount() ? pieces_.LineStart(line + 1)
+                                              : pieces_.Size();
+  string text;
+  string_view view = pieces_.Read(start, end, &text);
+  if (text.empty() || view.data() != text.data()) {
+    return TrimTerminator(view);
+  }
+
+  text.resize(TrimTerminator(text).size());
+  joined_lines_.push_back(joined_line_t{revision_, std::move(text)});
+  joined_by_line_[line] = &joined_lines_.back();
+  return joined_lines_.back().text;
+}
+
+string_view Document::GetLines(size_t first, size_t count,
+                               string *text) const {
+  unique_lock<mutex> lock(mutex_);
+  size_t lines = IndexedLineCount();
+  first = std::min(first, lines);
+  count = std::min(count, lines - first);
+  if (count == 0) return string_view();
+
+  if (!edited_) {
+    size_t start = line_starts_[first], last = first + count;
+    size_t end = last < line_starts_.size() ? line_starts_[last] : text_size_;
+    if (!gzip_index_) {
+      return string_view(data_ + start, end - start);
+    }
+
+    // Decompressing takes a while, GetLine doesn't have to wait for it
+    lock.unlock();
+    gzip_index_->Copy(start, end, text);
+    return *text;
+  }
+
+  size_t start = pieces_.LineStart(first), last = first + count;
+  size_t end = last < lines ? pieces_.LineStart(last) : pieces_.Size();
+  return pieces_.Read(start, end, text);
+}
+
+string_view Document::GetIndexedLine(size_t line) const {
+  size_t start = line_starts_[line];
+  size_t end =
+      line + 1 < line_starts_.size() ? line_starts_[line + 1] : text_size_;
+
+  const char *text;
+  if (gzip_index_) {
+    text = gzip_index_->Read(start, end);
+  } else {
+    text = data_ + start;
+  }
+
+  return TrimTerminator(string_view(text, end - start));
+}
+
+bool Document::IsEditable() const { return indexed_ && !gzip_index_; }
+
+bool Document::IsModified() const { return modified_; }
+
+uint64_t Document::GetRevision() const { return revision_; }
+
+void Document::ReplaceText(size_t first_line, size_t first_column,
+                           size_t last_line, size_t last_column,
+                           string_view text) {
+  assert(IsEditable());
+
+  lock_guard<mutex> lock(mutex_);
+  // The first edit starts from the whole file as a single piece
+  if (!edited_) {
+    pieces_.Reset(string_view(data_, text_size_), &line_starts_);
+    edited_ = true;
+    size_t first_end = line_starts_.size() > 1 ? line_starts_[1] : text_size_;
+    terminator_ = "\n";
+    if (first_end >= 2 && data_[first_end - 1] == '\n' &&
+        data_[first_end - 2] == '\r') {
+      terminator_ = "\r\n";
+    }
+  }
+
+  size_t begin = pieces_.LineStart(first_line) + first_column;
+  size_t end = pieces_.LineStart(last_line) + last_column;
+  assert(begin <= end && end <= pieces_.Size());
+  pieces_.Erase(begin, end - begin);
+
+  if (terminator_ == "\n" || text.find('\n') == string_view::npos) {
+    pieces_.Insert(begin, text);
+  } else {
+    string terminated;
+    for (char c : text) {
+      if (c == '\n') {
+        terminated.append(terminator_);
+      } else {
+        terminated.push_back(c);
+      }
+    }
+    pieces_.Insert(begin, terminated);
+  }
+  modified_ = true;
+  revision_++;
+
+  // Lines moved, and the ones returned before the last edit can go
+  joined_by_line_.clear();
+  while (!joined_lines_.empty() &&
+         joined_lines_.front().revision + 1 < revision_) {
+    edited_line_hashes_.erase(joined_lines_.front().text.data());
+    joined_lines_.pop_front();
+  }
+}
+
+bool Document::Save() {
+  if (!modified_) return true;
+  assert(IsEditable());
+
+  // Write next to the file and then move over it, so that the file is never
+  // left half written
+  string temp_path = path_ + ".tmp";
+  FILE *file = fopen(temp_path.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Could not write file: %s\n", temp_path.c_str());
+    return false;
+  }
+
+  bool written = true;
+  {
+    lock_guard<mutex> lock(mutex_);
+    pieces_.ForEachPiece([&](string_view piece) {
+      written = written &&
+                fwrite(piece.data(), 1, piece.size(), file) == piece.size();
+    });
+  }
+
+  // Keep the permissions of the file
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) == 0) {
+    fchmod(fileno(file), file_stat.st_mode & 07777);
+  }
+
+  written = written && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temp_path.c_str(), path_.c_str()) == -1) {
+    fprintf(stderr, "Could not save file: %s\n", path_.c_str());
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  // The mapping of the file which was replaced stays valid, so the pieces
+  // keep pointing into it
+  lock_guard<mutex> lock(mutex_);
+  if (stat(path_.c_str(), &file_stat) == 0) {
+    saved_device_ = file_stat.st_dev;
+    saved_inode_ = file_stat.st_ino;
+    saved_size_ = file_stat.st_size;
+  }
+  modified_ = false;
+  return true;
+}
+
+bool Document::WaitForLines(size_t count) const {
+  unique_lock<mutex> lock(mutex_);
+  lines_indexed_.wait(lock, [this, count]() {
+    return IndexedLineCount() >= count || indexed_;
+  });
+  return IndexedLineCount() >= count;
+}
+
+bool Document::IsIndexed() const { return indexed_; }
+
+size_t Document::ApproximateLineCount() const {
+  lock_guard<mutex> lock(mutex_);
+  size_t indexed_bytes = indexed_bytes_;
+  if (indexed_ || indexed_bytes == 0) {
+    return IndexedLineCount();
+  }
+  // For compressed files this assumes a constant compression ratio
+  return static_cast<double>(line_starts_.size()) * size_ / indexed_bytes;
+}
+
+double Document::IndexingProgress() const {
+  if (indexed_ || size_ == 0) return 1;
+  return static_cast<double>(indexed_bytes_) / size_;
+}
+
+}  // namespace document
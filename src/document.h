@@ -0,0 +1,201 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_DOCUMENT_H_
+#define SRC_DOCUMENT_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "./gzip_index.h"
+#include "./piece_table.h"
+
+namespace document {
+using gzip_index::GzipIndex;
+using piece_table::PieceTable;
+using std::atomic;
+using std::condition_variable;
+using std::deque;
+using std::function;
+using std::mutex;
+using std::string;
+using std::string_view;
+using std::thread;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+// A text file, memory mapped and split into lines by a background thread.
+// The document is usable while it is being indexed: it just looks like a file
+// which keeps growing until indexing is done.
+// Lines of plain files are views into the mapping and stay valid as long as
+// the Document. Gzip files are decompressed on demand around the lines being
+// read, so their lines are only valid until a few more blocks are read, see
+// GzipIndex::Read.
+// Once indexed, plain files can be edited. Edits go in a piece table over the
+// mapping, which stays in use once the document is saved, and lines which
+// were not edited keep their hashes. An edited document which ends with a
+// newline has an empty last line after it, like in most editors.
+class Document {
+ public:
+  // on_progress is called from the indexing thread every time new lines are
+  // available
+  Document(const string &path, function<void()> on_progress);
+  ~Document();
+
+  // Returns true if the first `count` lines have been indexed
+  bool HasLines(size_t count) const;
+  // Returns the number of lines indexed so far
+  size_t LineCount() const;
+  // Returns the line without its line terminator ("\n" or "\r\n"), the line
+  // must have been indexed already
+  string_view GetLine(size_t line) const;
+  // Returns a hash of the content of the line, as returned by GetLine. It's
+  // computed the first time it's asked for and then remembered
+  uint64_t GetLineHash(size_t line) const;
+  // Returns the text of up to `count` lines starting at `first`, with their
+  // line terminators but maybe the last one's. Plain files are returned
+  // straight from the mapping, until the next Refresh. Compressed files are
+  // decompressed in text, without touching the blocks GetLine reads from, so
+  // it can be used on other threads than the one using GetLine. Edited lines
+  // are copied in text, unless they are all in a piece, see PieceTable::Read
+  string_view GetLines(size_t first, size_t count, string *text) const;
+
+  // Block until the first `count` lines are indexed, or the whole file is
+  bool WaitForLines(size_t count) const;
+  // Returns true when the whole file has been indexed
+  bool IsIndexed() const;
+  // Returns the number of lines, extrapolated from the part of the file which
+  // has been indexed so far. Exact once IsIndexed() returns true
+  size_t ApproximateLineCount() const;
+  // Returns the fraction of the file which has been indexed
+  double IndexingProgress() const;
+
+  // Catch up with changes to the file on disk. Appended bytes are indexed
+  // incrementally, a truncated or replaced (rotated) file is reopened from
+  // scratch, as is a saved file which changed since. Previously returned
+  // lines are invalidated. Returns false if the document is still being
+  // indexed or has unsaved edits, or if the new file can't be opened, in
+  // which case nothing is done
+  bool Refresh();
+
+  // Returns true if the document can be edited: it's fully indexed and not
+  // compressed
+  bool IsEditable() const;
+  // Returns true if there are edits which have not been saved
+  bool IsModified() const;
+  // Returns a number which changes every time lines are edited, and when the
+  // document is opened again
+  uint64_t GetRevision() const;
+  // Replace the text from a column of a line to a column of another one,
+  // columns being bytes from the start of the line, with `text`, whose
+  // newlines become line terminators like the ones of the file. Previously
+  // returned lines stay valid until the edit after this one
+  void ReplaceText(size_t first_line, size_t first_column, size_t last_line,
+                   size_t last_column, string_view text);
+  // Write the document to its file, replacing it. The edits stay as they
+  // are, so editing goes on while the saved file is there. Returns false if
+  // the file could not be written
+  bool Save();
+
+  // Disable copy
+  Document(const Document &) = delete;
+  // Disable move
+  Document &operator=(const Document &) = delete;
+
+ private:
+  string path_;
+  int fd_ = -1;
+  // Identifies the file we have mapped, to notice when it gets replaced
+  dev_t device_;
+  ino_t inode_;
+
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  // Only set for gzip files
+  unique_ptr<GzipIndex> gzip_index_;
+
+  function<void()> on_progress_;
+
+  // Guards line_starts_, which the indexing thread appends to
+  mutable mutex mutex_;
+  mutable condition_variable lines_indexed_;
+  // Offset of the first byte of each line found so far
+  vector<size_t> line_starts_;
+  // Hashes of the lines which have been asked for, 0 when not computed yet.
+  // In pages allocated on first use, so that only the parts of the document
+  // which have been looked at take memory
+  mutable vector<unique_ptr<uint64_t[]>> line_hash_pages_;
+  // The edited text, used from the first edit until the document is opened
+  // again
+  PieceTable pieces_;
+  bool edited_ = false;
+  bool modified_ = false;
+  // Identifies the file we saved, which is what the edits look like
+  dev_t saved_device_ = 0;
+  ino_t saved_inode_ = 0;
+  off_t saved_size_ = -1;
+  // What newlines typed in become, "\r\n" if the file uses it
+  string_view terminator_;
+  // Edited lines which are in more than a piece, joined to be returned.
+  // They are kept for a revision more than they are used, so that the lines
+  // returned before an edit are still there after it
+  typedef struct {
+    uint64_t revision;
+    string text;
+  } joined_line_t;
+  mutable deque<joined_line_t> joined_lines_;
+  // The joined lines of the current revision
+  mutable unordered_map<size_t, const joined_line_t *> joined_by_line_;
+  // Hashes of edited lines, by where their text is. The text never changes
+  // as long as it's there, but it may get longer by typing at its end
+  typedef struct {
+    size_t length;
+    uint64_t hash;
+  } text_hash_t;
+  mutable unordered_map<const char *, text_hash_t> edited_line_hashes_;
+  // Read by the threads which search the document
+  atomic<uint64_t> revision_{0};
+  // How much text has been indexed, for gzip files this is the size of what
+  // has been decompressed so far
+  size_t text_size_ = 0;
+  // How many bytes of the file have been indexed
+  atomic<size_t> indexed_bytes_{0};
+  atomic<bool> indexed_{false};
+
+  atomic<bool> stop_indexing_{false};
+  thread indexing_thread_;
+
+  // Returns false if the file can't be opened, in which case the file which
+  // was open stays open
+  bool Open();
+  void Close();
+  void Map();
+  void Index();
+  void IndexPlain();
+  void IndexCompressed();
+  void IndexAppended(size_t old_size);
+  size_t IndexedLineCount() const;
+  // GetLine, with the lock held
+  string_view LookUpLine(size_t line) const;
+  string_view GetIndexedLine(size_t line) const;
+  uint64_t GetIndexedLineHash(size_t line) const;
+  string_view GetEditedLine(size_t line) const;
+  uint64_t GetEditedLineHash(string_view text) const;
+  // Returns true if text is a line of the file as it is in the mapping
+  bool FindIndexedLine(string_view text, size_t *line) const;
+};
+
+}  // namespace document
+
+#endif  // SRC_DOCUMENT_H_
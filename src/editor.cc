@@ -0,0 +1,191 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./editor.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace editor {
+
+// Continuation bytes of UTF-8 sequences look like 10xxxxxx
+static bool IsContinuation(char c) {
+  return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+}
+
+Editor::Editor(Document *document, State *state, WrapIndex *wrap_index,
+               Highlighter *highlighter,
+               function<void(const edit_t &)> on_edit)
+    : document_(document),
+      state_(state),
+      wrap_index_(wrap_index),
+      highlighter_(highlighter),
+      on_edit_(on_edit) {}
+
+bool Editor::IsInserting() const { return inserting_; }
+
+bool Editor::StartInserting(size_t line) {
+  if (!document_->IsEditable()) return false;
+
+  size_t lines = document_->LineCount();
+  inserting_ = true;
+  line_ = lines == 0 ? 0 : std::min(line, lines - 1);
+  column_ = 0;
+  ShowCaret();
+  return true;
+}
+
+void Editor::StopInserting() { inserting_ = false; }
+
+size_t Editor::GetCaretLine() const { return line_; }
+
+size_t Editor::GetCaretColumn() const { return column_; }
+
+string_view Editor::CaretLine() const {
+  if (line_ >= document_->LineCount()) return string_view();
+  return document_->GetLine(line_);
+}
+
+void Editor::Replace(size_t first_line, size_t first_column,
+                     size_t last_line, size_t last_column, string_view text) {
+  // An empty document gets its first line
+  size_t removed =
+      document_->LineCount() == 0 ? 0 : last_line - first_line + 1;
+  size_t added = std::count(text.begin(), text.end(), '\n') + 1;
+  document_->ReplaceText(first_line, first_column, last_line, last_column,
+                         text);
+
+  // The rows of the lines which were not touched stay measured. The first
+  // edit may add an empty last line, see Document
+  if (state_->IsWrapping()) {
+    wrap_index_->Splice(first_line, removed, added);
+    wrap_index_->Resize(document_->LineCount());
+  }
+  highlighter_->Splice(first_line, removed, added);
+}
+
+void Editor::EditLine(size_t start, size_t removed, string_view text) {
+  if (document_->LineCount() == 0) {
+    Replace(0, 0, 0, 0, text);
+    return;
+  }
+
+  edit_t edit = {line_, CaretLine(), document_->GetLineHash(line_), start,
+                 removed, text.size()};
+  Replace(line_, start, line_, start + removed, text);
+  if (on_edit_) on_edit_(edit);
+}
+
+void Editor::ClampColumn() {
+  string_view line = CaretLine();
+  column_ = std::min(column_, line.size());
+  while (column_ > 0 && column_ < line.size() &&
+         IsContinuation(line[column_])) {
+    column_--;
+  }
+}
+
+void Editor::ShowCaret() { state_->ShowLine(line_, *wrap_index_); }
+
+void Editor::Insert(string_view text) {
+  if (!document_->IsEditable()) return;
+  EditLine(column_, 0, text);
+  column_ += text.size();
+  ShowCaret();
+}
+
+void Editor::InsertNewline() {
+  if (!document_->IsEditable()) return;
+  Replace(line_, column_, line_, column_, "\n");
+  line_++;
+  column_ = 0;
+  ShowCaret();
+}
+
+void Editor::DeleteBackward() {
+  if (!document_->IsEditable()) return;
+  if (column_ == 0) {
+    // Join with the line before
+    if (line_ == 0) return;
+    size_t previous_length = document_->GetLine(line_ - 1).size();
+    Replace(line_ - 1, previous_length, line_, 0, string_view());
+    line_--;
+    column_ = previous_length;
+  } else {
+    string_view line = CaretLine();
+    size_t start = column_ - 1;
+    while (start > 0 && IsContinuation(line[start])) start--;
+
+    EditLine(start, column_ - start, string_view());
+    column_ = start;
+  }
+  ShowCaret();
+}
+
+void Editor::DeleteForward() {
+  if (!document_->IsEditable()) return;
+  string_view line = CaretLine();
+  if (column_ == line.size()) {
+    // Join with the line after
+    if (line_ + 1 >= document_->LineCount()) return;
+    Replace(line_, column_, line_ + 1, 0, string_view());
+  } else {
+    size_t end = column_ + 1;
+    while (end < line.size() && IsContinuation(line[end])) end++;
+
+    EditLine(column_, end - column_, string_view());
+  }
+  ShowCaret();
+}
+
+void Editor::MoveLeft() {
+  string_view line = CaretLine();
+  if (column_ > 0) {
+    column_--;
+    while (column_ > 0 && IsContinuation(line[column_])) column_--;
+  } else if (line_ > 0) {
+    line_--;
+    column_ = CaretLine().size();
+  }
+  ShowCaret();
+}
+
+void Editor::MoveRight() {
+  string_view line = CaretLine();
+  if (column_ < line.size()) {
+    column_++;
+    while (column_ < line.size() && IsContinuation(line[column_])) column_++;
+  } else if (line_ + 1 < document_->LineCount()) {
+    line_++;
+    column_ = 0;
+  }
+  ShowCaret();
+}
+
+void Editor::MoveUp() {
+  if (line_ > 0) {
+    line_--;
+    ClampColumn();
+  }
+  ShowCaret();
+}
+
+void Editor::MoveDown() {
+  if (line_ + 1 < document_->LineCount()) {
+    line_++;
+    ClampColumn();
+  }
+  ShowCaret();
+}
+
+void Editor::MoveToLineStart() {
+  column_ = 0;
+  ShowCaret();
+}
+
+void Editor::MoveToLineEnd() {
+  column_ = CaretLine().size();
+  ShowCaret();
+}
+
+bool Editor::Save() { return document_->Save(); }
+
+}  // namespace editor
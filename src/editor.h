@@ -0,0 +1,101 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_EDITOR_H_
+#define SRC_EDITOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+#include "./document.h"
+#include "./highlighter.h"
+#include "./state.h"
+#include "./wrap_index.h"
+
+namespace editor {
+using document::Document;
+using highlighter::Highlighter;
+using state::State;
+using std::function;
+using std::string_view;
+using wrap_index::WrapIndex;
+
+// An edit inside of a line, which replaced `removed` bytes at `start` with
+// `inserted` new ones. The line as it was is still valid, see
+// Document::ReplaceText
+typedef struct {
+  size_t line;
+  string_view old_text;
+  uint64_t old_hash;
+  size_t start;
+  size_t removed;
+  size_t inserted;
+} edit_t;
+
+// Editing the document with a caret, which is a line and a byte of it at the
+// start of a UTF-8 sequence. Typing only edits the document in insert mode.
+// Every edit replaces the text between two carets, the rest of the document,
+// and what is known about it, is left alone. The screen follows the caret.
+class Editor {
+ public:
+  // on_edit is called after each edit inside of a line, so that what is
+  // known about the line can be updated instead of thrown away
+  Editor(Document *document, State *state, WrapIndex *wrap_index,
+         Highlighter *highlighter, function<void(const edit_t &)> on_edit);
+
+  bool IsInserting() const;
+  // Enter insert mode with the caret at the beginning of the line. Returns
+  // false if the document can't be edited
+  bool StartInserting(size_t line);
+  void StopInserting();
+  size_t GetCaretLine() const;
+  size_t GetCaretColumn() const;
+
+  // Insert text without line terminators at the caret, and move past it.
+  // This and the edits below do nothing while the document can't be edited,
+  // like while it's indexed again after being replaced on disk
+  void Insert(string_view text);
+  // Split the line at the caret
+  void InsertNewline();
+  // Delete the codepoint before or after the caret, joining lines at their
+  // ends
+  void DeleteBackward();
+  void DeleteForward();
+
+  void MoveLeft();
+  void MoveRight();
+  void MoveUp();
+  void MoveDown();
+  void MoveToLineStart();
+  void MoveToLineEnd();
+
+  // Returns false if the document could not be saved
+  bool Save();
+
+ private:
+  Document *document_;
+  State *state_;
+  WrapIndex *wrap_index_;
+  Highlighter *highlighter_;
+  function<void(const edit_t &)> on_edit_;
+
+  bool inserting_ = false;
+  size_t line_ = 0;
+  size_t column_ = 0;
+
+  // The line with the caret, empty when the document has no lines
+  string_view CaretLine() const;
+  // Replace the text from a column of a line to a column of another one in
+  // the document, and its lines in the wrap index and in the highlighter
+  void Replace(size_t first_line, size_t first_column, size_t last_line,
+               size_t last_column, string_view text);
+  // Replace `removed` bytes at `start` of the caret's line with `text`
+  void EditLine(size_t start, size_t removed, string_view text);
+  // Move the caret back to the start of the codepoint it is in
+  void ClampColumn();
+  void ShowCaret();
+};
+
+}  // namespace editor
+
+#endif  // SRC_EDITOR_H_
@@ -1,7 +1,48 @@
 // Copyright 2019 <Andrea Cognolato>
 #include "./face_collection.h"
 
+#include <algorithm>
+#include <utility>
+
+#include "./hash.h"
+
 namespace face_collection {
+static shaping_context_t CreateShapingContext(FT_Face face) {
+  shaping_context_t context;
+
+  // Create a font using the face provided by freetype, its size has to be
+  // set already
+  context.font = hb_ft_font_create(face, nullptr);
+  // Measure glyphs the same way they are rendered
+  hb_ft_font_set_load_flags(context.font,
+                            FT_LOAD_DEFAULT | FT_LOAD_TARGET_LCD);
+
+  for (const char *feature : {"kern=1", "liga=1", "clig=1"}) {
+    hb_feature_t parsed;
+    if (!hb_feature_from_string(feature, -1, &parsed)) {
+      fprintf(stderr, "Could not parse the font feature: %s\n", feature);
+      exit(EXIT_FAILURE);
+    }
+    context.features.push_back(parsed);
+  }
+
+  // The script, language and direction of all the text we shape
+  context.properties = {};
+  context.properties.direction = HB_DIRECTION_LTR;
+  context.properties.script = HB_SCRIPT_LATIN;
+  context.properties.language = hb_language_from_string("en", -1);
+
+  // Choosing the shaper and compiling the lookups of the features only
+  // depends on the above, so it's done once here instead of on each shape
+  context.shape_plan = hb_shape_plan_create_cached(
+      hb_font_get_face(context.font), &context.properties,
+      context.features.data(), context.features.size(), nullptr);
+
+  context.ascii_shaper.Load(context.font, face);
+
+  return context;
+}
+
 FaceCollection LoadFaces(FT_Library ft, const vector<string> &face_names) {
   FaceCollection faces;
 
@@ -38,105 +79,321 @@ FaceCollection LoadFaces(FT_Library ft, const vector<string> &face_names) {
       width = (face->available_sizes[0].width);
       height = (face->available_sizes[0].height);
     }
-    faces.push_back(make_tuple(face, width, height));
+    faces.push_back(
+        make_tuple(face, width, height, CreateShapingContext(face)));
   }
 
   return faces;
 }
 
-void AssignCodepointsFaces(const string &text, const FaceCollection &faces,
-                           CodePointsFacePair *codepoint_faces_pair,
-                           hb_buffer_t *buf) {
-  const hb_codepoint_t CODEPOINT_MISSING_FACE = UINT32_MAX;
-  const hb_codepoint_t CODEPOINT_MISSING = UINT32_MAX;
-  // Flag to break the for loop when all of the codepoints have been assigned
-  // to a face
-  bool all_codepoints_have_a_face = true;
-  for (size_t i = 0; (i < faces.size()) && all_codepoints_have_a_face; i++) {
-    all_codepoints_have_a_face = false;
-
-    // Reset the buffer, which is reused inbetween iterations
-    hb_buffer_clear_contents(buf);
-
-    // Put the text in the buffer
-    hb_buffer_add_utf8(buf, text.data(), text.length(), 0, -1);
-
-    // Set the script, language and direction of the buffer
-    hb_buffer_set_direction(buf, HB_DIRECTION_LTR);
-    hb_buffer_set_script(buf, HB_SCRIPT_LATIN);
-    hb_buffer_set_language(buf, hb_language_from_string("en", -1));
-
-    // Create a font using the face provided by freetype
-    FT_Face face = get<0>(faces[i]);
-    hb_font_t *font = hb_ft_font_create(face, nullptr);
-
-    vector<hb_feature_t> features(3);
-    assert(hb_feature_from_string("kern=1", -1, &features[0]));
-    assert(hb_feature_from_string("liga=1", -1, &features[1]));
-    assert(hb_feature_from_string("clig=1", -1, &features[2]));
-
-    // Shape the font
-    hb_shape(font, buf, &features[0], features.size());
-
-    // Get the glyph and position information
-    unsigned int glyph_info_length;
-    // unsigned int glyph_position_length;
-    hb_glyph_info_t *glyph_info =
-        hb_buffer_get_glyph_infos(buf, &glyph_info_length);
-    // hb_glyph_position_t *glyph_pos =
-    // hb_buffer_get_glyph_positions(buf, &glyph_position_length);
-
-    // assert(glyph_info_length == glyph_position_length);
-
-    // Assign a size to the vector on the first iteration and fill it with
-    // UINT32_MAX which represents the absence of a value This assumes that
-    // all of the face runs will have the same lengths
-    if (i == 0) {
-      codepoint_faces_pair->first.resize(glyph_info_length,
-                                         CODEPOINT_MISSING_FACE);
-      codepoint_faces_pair->second.resize(glyph_info_length, CODEPOINT_MISSING);
+FaceCoverage LoadCoverage(const FaceCollection &faces) {
+  FaceCoverage coverage;
+  for (auto &face : faces) {
+    coverage.AddFace(get<0>(face));
+  }
+  return coverage;
+}
+
+void UnloadFaces(const FaceCollection &faces) {
+  for (auto &face : faces) {
+    const shaping_context_t &context = get<3>(face);
+    hb_shape_plan_destroy(context.shape_plan);
+    hb_font_destroy(context.font);
+    FT_Done_Face(get<0>(face));
+  }
+}
+
+size_t ShapingChunkLength(string_view text) {
+  if (text.size() <= kShapingChunkSize) {
+    return text.size();
+  }
+
+  // Prefer ending the chunk after a space, since no ligature or kerning pair
+  // spans across it
+  for (size_t i = kShapingChunkSize; i > kShapingChunkSize / 2; i--) {
+    if (text[i - 1] == ' ' || text[i - 1] == '\t') {
+      return i;
     }
-    assert(glyph_info_length == codepoint_faces_pair->first.size());
-
-    // Asssign a face to each codepoint if the codepoint hasn't been assigned
-    // yet
-    for (size_t j = 0; j < glyph_info_length; j++) {
-      hb_codepoint_t codepoint = glyph_info[j].codepoint;
-      // hb_position_t x_offset = glyph_pos[j].x_offset >> 6;
-      // hb_position_t y_offset = glyph_pos[j].y_offset >> 6;
-      // hb_position_t x_advance = glyph_pos[j].x_advance >> 6;
-      // hb_position_t y_advance = glyph_pos[j].y_advance >> 6;
-      // TODO(andrea): use harfbuzz glyph info instead of FreeType's
-
-      if (codepoint != 0 &&
-          (codepoint_faces_pair->first)[j] == CODEPOINT_MISSING) {
-        codepoint_faces_pair->first[j] = i;
-        codepoint_faces_pair->second[j] = codepoint;
-      }
+  }
 
-      // If we find a glyph which is not present in this face (therefore its
-      // codepoint it's 0) and which has not been assigned already then we
-      // need to iterate on the next font
-      if (codepoint == 0 &&
-          (codepoint_faces_pair->second)[j] == CODEPOINT_MISSING) {
-        all_codepoints_have_a_face = true;
-      }
+  // Otherwise at least don't split a UTF-8 sequence, whose continuation bytes
+  // look like 10xxxxxx. Bytes which aren't valid UTF-8 can be split anywhere
+  for (size_t i = kShapingChunkSize; i > kShapingChunkSize / 2; i--) {
+    if ((static_cast<unsigned char>(text[i]) & 0xC0) != 0x80) {
+      return i;
     }
+  }
+  return kShapingChunkSize;
+}
+
+// Returns the codepoint starting at text[*i] and moves past it. Invalid
+// sequences decode to U+FFFD one byte at a time
+static hb_codepoint_t DecodeUtf8(string_view text, size_t *i) {
+  const hb_codepoint_t REPLACEMENT_CHARACTER = 0x0000FFFD;
+  auto byte = [&](size_t j) { return static_cast<unsigned char>(text[j]); };
 
-    // Free the face and the buffer
-    hb_font_destroy(font);
+  unsigned char lead = byte(*i);
+  size_t length;
+  hb_codepoint_t codepoint;
+  if (lead < 0x80) {
+    (*i)++;
+    return lead;
+  } else if ((lead & 0xE0) == 0xC0) {
+    length = 2;
+    codepoint = lead & 0x1F;
+  } else if ((lead & 0xF0) == 0xE0) {
+    length = 3;
+    codepoint = lead & 0x0F;
+  } else if ((lead & 0xF8) == 0xF0) {
+    length = 4;
+    codepoint = lead & 0x07;
+  } else {
+    (*i)++;
+    return REPLACEMENT_CHARACTER;
   }
 
-  for (size_t i = 0; i < codepoint_faces_pair->first.size(); i++) {
-    size_t face = codepoint_faces_pair->first[i];
-    hb_codepoint_t codepoint = codepoint_faces_pair->second[i];
+  if (*i + length > text.size()) {
+    (*i)++;
+    return REPLACEMENT_CHARACTER;
+  }
+  for (size_t j = 1; j < length; j++) {
+    if ((byte(*i + j) & 0xC0) != 0x80) {
+      (*i)++;
+      return REPLACEMENT_CHARACTER;
+    }
+    codepoint = (codepoint << 6) | (byte(*i + j) & 0x3F);
+  }
+  *i += length;
+  return codepoint;
+}
+
+// Codepoints which only modify the ones before them: combining marks, zero
+// width joiners, variation selectors, emoji modifiers and tags. They must be
+// shaped together with what they modify
+static bool ExtendsCluster(hb_codepoint_t codepoint) {
+  return (codepoint >= 0x0300 && codepoint <= 0x036F) || codepoint == 0x200D ||
+         (codepoint >= 0xFE00 && codepoint <= 0xFE0F) ||
+         (codepoint >= 0x1F3FB && codepoint <= 0x1F3FF) ||
+         (codepoint >= 0xE0020 && codepoint <= 0xE007F) ||
+         (codepoint >= 0xE0100 && codepoint <= 0xE01EF);
+}
+
+// Shape the text with a single face and append the glyphs
+static void ShapeRun(string_view text, size_t face_index,
+                     const FaceCollection &faces, ShapedText *shaped_text,
+                     hb_buffer_t *buf) {
+  const shaping_context_t &context = get<3>(faces[face_index]);
+  FT_Face face = get<0>(faces[face_index]);
+
+  // Reset the buffer, which is reused inbetween runs
+  hb_buffer_clear_contents(buf);
+
+  // Put the text in the buffer
+  hb_buffer_add_utf8(buf, text.data(), text.length(), 0, -1);
+  hb_buffer_set_segment_properties(buf, &context.properties);
+
+  // Shape the run
+  if (!hb_shape_plan_execute(context.shape_plan, context.font, buf,
+                             context.features.data(),
+                             context.features.size())) {
+    fprintf(stderr, "Could not shape text\n");
+    exit(EXIT_FAILURE);
+  }
 
-    if (face == CODEPOINT_MISSING_FACE && codepoint == CODEPOINT_MISSING) {
+  // Get the glyph and position information
+  unsigned int glyph_info_length;
+  unsigned int glyph_position_length;
+  hb_glyph_info_t *glyph_info =
+      hb_buffer_get_glyph_infos(buf, &glyph_info_length);
+  hb_glyph_position_t *glyph_pos =
+      hb_buffer_get_glyph_positions(buf, &glyph_position_length);
+
+  assert(glyph_info_length == glyph_position_length);
+
+  for (size_t j = 0; j < glyph_info_length; j++) {
+    hb_codepoint_t codepoint = glyph_info[j].codepoint;
+
+    // A glyph no face has, draw the replacement character of the first one
+    if (codepoint == 0) {
       const auto REPLACEMENT_CHARACTER = 0x0000FFFD;
-      codepoint_faces_pair->first[i] = 0;
-      codepoint_faces_pair->second[i] =
-          FT_Get_Char_Index(get<0>(faces[0]), REPLACEMENT_CHARACTER);
+      FT_Face first_face = get<0>(faces[0]);
+      codepoint = FT_Get_Char_Index(first_face, REPLACEMENT_CHARACTER);
+
+      FT_Fixed advance = 0;
+      FT_Get_Advance(first_face, codepoint,
+                     FT_LOAD_DEFAULT | FT_LOAD_TARGET_LCD, &advance);
+      shaped_text->faces.push_back(0);
+      shaped_text->codepoints.push_back(codepoint);
+      shaped_text->advances.push_back(advance >> 16);
+    } else {
+      shaped_text->faces.push_back(face_index);
+      shaped_text->codepoints.push_back(codepoint);
+      // Color glyphs are bitmaps of a fixed size, which get scaled down to
+      // the width of a cell
+      shaped_text->advances.push_back(
+          FT_HAS_COLOR(face) ? kFontPixelWidth : glyph_pos[j].x_advance >> 6);
     }
+
+    shaped_text->clusters.push_back(glyph_info[j].cluster);
+    shaped_text->unsafe_to_break.push_back(
+        (hb_glyph_info_get_glyph_flags(&glyph_info[j]) &
+         HB_GLYPH_FLAG_UNSAFE_TO_BREAK) != 0);
+  }
+}
+
+// Returns the length of the first token of the text: a word and the spaces
+// after it. Like for chunks, no ligature or kerning pair is expected to span
+// across spaces
+static size_t TokenLength(string_view text) {
+  auto is_space = [](char c) { return c == ' ' || c == '\t'; };
+
+  size_t i = 0;
+  while (i < text.size() && !is_space(text[i])) i++;
+  while (i < text.size() && is_space(text[i])) i++;
+  return i;
+}
+
+// Shape a run of a single face, which starts at byte offset of the text being
+// shaped, a token at a time going through the cache of shaped runs, and
+// append the glyphs. Tokens are shaped without the text around them as
+// context on purpose, so that the same word shapes the same wherever it is
+// and is found in the cache; only contextual forms across a space are lost
+static void ShapeTokens(string_view run, size_t offset, size_t face_index,
+                        const FaceCollection &faces,
+                        ShapingCache *shaping_cache, ShapedText *shaped_text,
+                        hb_buffer_t *buf) {
+  while (!run.empty()) {
+    auto token = run.substr(0, TokenLength(run));
+    run.remove_prefix(token.size());
+
+    uint64_t token_hash = hash::Hash(token);
+    const ShapedText *shaped_token =
+        shaping_cache->GetRun(face_index, token_hash, token);
+    if (shaped_token == nullptr) {
+      ShapedText shaped_run;
+      ShapeRun(token, face_index, faces, &shaped_run, buf);
+      shaped_token = &shaping_cache->InsertRun(face_index, token_hash, token,
+                                               std::move(shaped_run));
+    }
+
+    auto append = [](auto *to, const auto &from) {
+      to->insert(to->end(), from.begin(), from.end());
+    };
+    append(&shaped_text->faces, shaped_token->faces);
+    append(&shaped_text->codepoints, shaped_token->codepoints);
+    append(&shaped_text->advances, shaped_token->advances);
+    append(&shaped_text->unsafe_to_break, shaped_token->unsafe_to_break);
+    // The clusters of the token count from its start
+    for (uint32_t cluster : shaped_token->clusters) {
+      shaped_text->clusters.push_back(offset + cluster);
+    }
+    offset += token.size();
+  }
+}
+
+void AssignCodepointsFaces(string_view text, const FaceCollection &faces,
+                           const FaceCoverage &coverage,
+                           ShapingCache *shaping_cache,
+                           ShapedText *shaped_text, hb_buffer_t *buf) {
+  // Most lines are plain ASCII which the first face lays out glyph by glyph
+  if (get<3>(faces[0]).ascii_shaper.Shape(text, 0, shaped_text)) {
+    return;
+  }
+
+  // Split the text in runs of codepoints which the same face has, then shape
+  // each run once with its face. Codepoints no face has are left to the
+  // first one
+  size_t run_start = 0, run_face = 0;
+  size_t i = 0;
+  while (i < text.size()) {
+    size_t codepoint_start = i;
+    hb_codepoint_t codepoint = DecodeUtf8(text, &i);
+
+    size_t face = coverage.FaceFor(codepoint);
+    if (face == FaceCoverage::kNoFace) face = 0;
+    if (codepoint_start == 0) {
+      run_face = face;
+    } else if (face != run_face && !ExtendsCluster(codepoint)) {
+      ShapeTokens(text.substr(run_start, codepoint_start - run_start),
+                  run_start, run_face, faces, shaping_cache, shaped_text,
+                  buf);
+      run_start = codepoint_start;
+      run_face = face;
+    }
+  }
+
+  if (run_start < text.size()) {
+    ShapeTokens(text.substr(run_start), run_start, run_face, faces,
+                shaping_cache, shaped_text, buf);
+  }
+}
+
+void ReshapeEdit(string_view text, size_t start, size_t removed,
+                 size_t inserted, const FaceCollection &faces,
+                 const FaceCoverage &coverage, ShapingCache *shaping_cache,
+                 ShapedText *shaped_text, hb_buffer_t *buf) {
+  auto &clusters = shaped_text->clusters;
+  const auto &unsafe_to_break = shaped_text->unsafe_to_break;
+  size_t glyphs = clusters.size();
+  size_t old_length = text.size() + removed - inserted;
+
+  // Returns the first glyph of the cluster of glyph i
+  auto cluster_start = [&](size_t i) {
+    while (i > 0 && clusters[i - 1] == clusters[i]) i--;
+    return i;
+  };
+  // Returns the first glyph of the cluster after the one of glyph i
+  auto next_cluster = [&](size_t i) {
+    uint32_t cluster = clusters[i];
+    while (i < glyphs && clusters[i] == cluster) i++;
+    return i;
+  };
+
+  // The edited text is shaped again from a cluster before the edit, which
+  // keeps at least a cluster which didn't change between the glyphs which
+  // are kept and the ones which are shaped again, to where the text could
+  // be split
+  size_t first = std::upper_bound(clusters.begin(), clusters.end(), start) -
+                 clusters.begin();
+  if (first > 0) first = cluster_start(first - 1);
+  if (first > 0) first = cluster_start(first - 1);
+  while (first > 0 && unsafe_to_break[first]) {
+    first = cluster_start(first - 1);
+  }
+
+  // Likewise up to a cluster after the edit
+  size_t last = std::lower_bound(clusters.begin(), clusters.end(),
+                                 start + removed) -
+                clusters.begin();
+  if (last < glyphs) last = next_cluster(last);
+  while (last < glyphs && unsafe_to_break[last]) {
+    last = next_cluster(last);
+  }
+
+  size_t begin = first == 0 ? 0 : clusters[first];
+  size_t end = last == glyphs ? old_length : clusters[last];
+  // Where the kept glyphs after the edit are now
+  auto moved = [&](size_t cluster) { return cluster + inserted - removed; };
+
+  ShapedText middle;
+  AssignCodepointsFaces(text.substr(begin, moved(end) - begin), faces,
+                        coverage, shaping_cache, &middle, buf);
+
+  // The glyphs around the edit are replaced by the new ones, the ones before
+  // and after it stay where they are
+  auto splice = [&](auto *to, const auto &new_middle) {
+    to->erase(to->begin() + first, to->begin() + last);
+    to->insert(to->begin() + first, new_middle.begin(), new_middle.end());
+  };
+  splice(&shaped_text->faces, middle.faces);
+  splice(&shaped_text->codepoints, middle.codepoints);
+  splice(&shaped_text->advances, middle.advances);
+  splice(&shaped_text->unsafe_to_break, middle.unsafe_to_break);
+
+  for (uint32_t &cluster : middle.clusters) cluster += begin;
+  splice(&clusters, middle.clusters);
+  for (size_t i = first + middle.clusters.size(); i < clusters.size(); i++) {
+    clusters[i] = moved(clusters[i]);
   }
 }
 }  // namespace face_collection
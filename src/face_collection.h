@@ -8,33 +8,66 @@
 #include <harfbuzz/hb.h>
 
 #include <ft2build.h>
+#include FT_ADVANCES_H
 #include FT_FREETYPE_H
 #include FT_LCD_FILTER_H
 
 #include <cassert>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
+#include "./ascii_shaper.h"
 #include "./constants.h"
+#include "./coverage.h"
 #include "./shaping_cache.h"
 
 namespace face_collection {
-using shaping_cache::CodePointsFacePair;
+using ascii_shaper::AsciiShaper;
+using coverage::FaceCoverage;
+using shaping_cache::ShapedText;
 using shaping_cache::ShapingCache;
 using std::get;
 using std::make_tuple;
 using std::string;
+using std::string_view;
 using std::tuple;
 using std::vector;
 
-using SizedFace = tuple<FT_Face, GLsizei, GLsizei>;
+// Everything HarfBuzz needs to shape text with a face, created once when the
+// face is loaded
+typedef struct {
+  hb_font_t *font;
+  vector<hb_feature_t> features;
+  hb_segment_properties_t properties;
+  hb_shape_plan_t *shape_plan;
+  // For text none of the face's lookups apply to
+  AsciiShaper ascii_shaper;
+} shaping_context_t;
+
+using SizedFace = tuple<FT_Face, GLsizei, GLsizei, shaping_context_t>;
 using FaceCollection = vector<SizedFace>;
 
 FaceCollection LoadFaces(FT_Library ft, const vector<string> &face_names);
-void AssignCodepointsFaces(const string &text, const FaceCollection &faces,
-                           CodePointsFacePair *codepoint_faces_pair,
-                           hb_buffer_t *buf);
+void UnloadFaces(const FaceCollection &faces);
+FaceCoverage LoadCoverage(const FaceCollection &faces);
+// Long lines are split into chunks which are shaped independently. Returns
+// the length of the first chunk of text
+size_t ShapingChunkLength(string_view text);
+void AssignCodepointsFaces(string_view text, const FaceCollection &faces,
+                           const FaceCoverage &coverage,
+                           ShapingCache *shaping_cache,
+                           ShapedText *shaped_text, hb_buffer_t *buf);
+// Shape text which was edited, replacing `removed` bytes at `start` with the
+// `inserted` ones, from shaped_text, which is how it was shaped before and
+// is edited in place. Only the clusters around the edit are shaped again, up
+// to where HarfBuzz says the text can be split, so the cost doesn't depend
+// on how long the text is
+void ReshapeEdit(string_view text, size_t start, size_t removed,
+                 size_t inserted, const FaceCollection &faces,
+                 const FaceCoverage &coverage, ShapingCache *shaping_cache,
+                 ShapedText *shaped_text, hb_buffer_t *buf);
 
 }  // namespace face_collection
 
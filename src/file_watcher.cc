@@ -0,0 +1,110 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./file_watcher.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace file_watcher {
+static const uint32_t kFileEvents =
+    IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+static const uint32_t kDirectoryEvents = IN_CREATE | IN_MOVED_TO;
+
+FileWatcher::FileWatcher(const string &path, function<void()> on_change)
+    : path_(path), on_change_(on_change) {
+  auto slash = path_.find_last_of('/');
+  if (slash == string::npos) {
+    directory_ = ".";
+    file_name_ = path_;
+  } else {
+    directory_ = slash == 0 ? "/" : path_.substr(0, slash);
+    file_name_ = path_.substr(slash + 1);
+  }
+
+  inotify_fd_ = inotify_init1(IN_CLOEXEC);
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (inotify_fd_ == -1 || stop_fd_ == -1) {
+    fprintf(stderr, "Could not initialize inotify\n");
+    exit(EXIT_FAILURE);
+  }
+
+  file_watch_ = -1;
+  WatchFile();
+  // Rotation replaces the file, which only the directory gets to know about
+  directory_watch_ =
+      inotify_add_watch(inotify_fd_, directory_.c_str(), kDirectoryEvents);
+  if (file_watch_ == -1 || directory_watch_ == -1) {
+    fprintf(stderr, "Could not watch file: %s\n", path_.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  watching_thread_ = thread(&FileWatcher::Watch, this);
+}
+
+FileWatcher::~FileWatcher() {
+  uint64_t one = 1;
+  if (write(stop_fd_, &one, sizeof(one)) != sizeof(one)) {
+    fprintf(stderr, "Could not stop the file watcher\n");
+  }
+  watching_thread_.join();
+
+  close(stop_fd_);
+  close(inotify_fd_);
+}
+
+void FileWatcher::WatchFile() {
+  // The old watch goes away by itself if the file was deleted, but not if it
+  // was just renamed
+  if (file_watch_ != -1) {
+    inotify_rm_watch(inotify_fd_, file_watch_);
+  }
+  file_watch_ = inotify_add_watch(inotify_fd_, path_.c_str(), kFileEvents);
+}
+
+void FileWatcher::Watch() {
+  alignas(struct inotify_event) char buffer[4096];
+
+  struct pollfd fds[2];
+  fds[0].fd = inotify_fd_;
+  fds[0].events = POLLIN;
+  fds[1].fd = stop_fd_;
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    if (poll(fds, 2, -1) == -1) continue;
+    if (fds[1].revents & POLLIN) return;
+
+    ssize_t length = read(inotify_fd_, buffer, sizeof(buffer));
+    if (length <= 0) continue;
+
+    bool changed = false;
+    for (char *p = buffer; p < buffer + length;) {
+      auto event = reinterpret_cast<struct inotify_event *>(p);
+      p += sizeof(struct inotify_event) + event->len;
+
+      if (event->wd == directory_watch_) {
+        // A new file took the place of the one we were following
+        if (event->len > 0 && file_name_ == event->name) {
+          WatchFile();
+          changed = true;
+        }
+      } else if (event->wd == file_watch_) {
+        changed = true;
+      }
+    }
+
+    if (changed) {
+      changed_ = true;
+      if (on_change_) on_change_();
+    }
+  }
+}
+
+bool FileWatcher::ConsumeChanges() { return changed_.exchange(false); }
+
+}  // namespace file_watcher
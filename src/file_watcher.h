@@ -0,0 +1,54 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_FILE_WATCHER_H_
+#define SRC_FILE_WATCHER_H_
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace file_watcher {
+using std::atomic;
+using std::function;
+using std::string;
+using std::thread;
+
+// Watches a file with inotify from a background thread. Besides changes to
+// the file itself it notices when the file is replaced by a new one with the
+// same name, which is what log rotation does.
+class FileWatcher {
+ public:
+  // on_change is called from the watching thread after every change
+  FileWatcher(const string &path, function<void()> on_change);
+  ~FileWatcher();
+
+  // Returns true if the file changed since the last call
+  bool ConsumeChanges();
+
+  // Disable copy
+  FileWatcher(const FileWatcher &) = delete;
+  // Disable move
+  FileWatcher &operator=(const FileWatcher &) = delete;
+
+ private:
+  string path_;
+  string directory_;
+  string file_name_;
+  function<void()> on_change_;
+
+  int inotify_fd_;
+  // Written to by the destructor to wake up and stop the watching thread
+  int stop_fd_;
+  int file_watch_;
+  int directory_watch_;
+
+  atomic<bool> changed_{false};
+  thread watching_thread_;
+
+  void Watch();
+  void WatchFile();
+};
+
+}  // namespace file_watcher
+
+#endif  // SRC_FILE_WATCHER_H_
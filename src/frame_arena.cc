@@ -0,0 +1,87 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./frame_arena.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+// Every thread counts its own allocations, so that the frames drawn aren't
+// charged with the indexing threads' ones
+static thread_local uint64_t heap_allocations = 0;
+
+void *operator new(size_t size) {
+  heap_allocations++;
+  void *memory = malloc(size == 0 ? 1 : size);
+  if (memory == nullptr) throw std::bad_alloc();
+  return memory;
+}
+
+void operator delete(void *memory) noexcept { free(memory); }
+
+void operator delete(void *memory, size_t) noexcept { free(memory); }
+
+namespace frame_arena {
+
+uint64_t HeapAllocations() { return heap_allocations; }
+
+FrameArena::FrameArena(size_t initial_size) {
+  stats_ = {0, 0, 0, 0, 0, 0};
+  AddBlock(initial_size);
+}
+
+void FrameArena::AddBlock(size_t size) {
+  blocks_.emplace_back(new unsigned char[size]);
+  block_sizes_.push_back(size);
+  used_ = 0;
+
+  stats_.heap_allocations++;
+  stats_.frame_heap_allocations++;
+  stats_.capacity += size;
+}
+
+void FrameArena::Reset() {
+  stats_.frames++;
+  stats_.peak_bytes = std::max(stats_.peak_bytes, stats_.frame_bytes);
+
+  // The last frame didn't fit in a block, make one which fits all of it.
+  // It's rounded up to a power of two so that frames which keep growing a
+  // little don't take a new block every time
+  if (blocks_.size() > 1) {
+    size_t size = 1;
+    while (size < stats_.capacity) size *= 2;
+
+    blocks_.clear();
+    block_sizes_.clear();
+    stats_.capacity = 0;
+    stats_.frame_heap_allocations = 0;
+    AddBlock(size);
+  } else {
+    stats_.frame_heap_allocations = 0;
+  }
+
+  used_ = 0;
+  stats_.frame_bytes = 0;
+}
+
+void *FrameArena::Allocate(size_t size, size_t alignment) {
+  assert(alignment <= alignof(std::max_align_t));
+
+  size_t offset = (used_ + alignment - 1) & ~(alignment - 1);
+  if (offset + size > block_sizes_.back()) {
+    // Blocks at least double, so a frame only takes a few of them
+    AddBlock(std::max(size, 2 * block_sizes_.back()));
+    offset = 0;
+  }
+
+  used_ = offset + size;
+  stats_.frame_bytes += size;
+  return blocks_.back().get() + offset;
+}
+
+arena_stats_t FrameArena::GetStats() const {
+  arena_stats_t stats = stats_;
+  stats.peak_bytes = std::max(stats.peak_bytes, stats.frame_bytes);
+  return stats;
+}
+
+}  // namespace frame_arena
@@ -0,0 +1,123 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_FRAME_ARENA_H_
+#define SRC_FRAME_ARENA_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace frame_arena {
+using std::unique_ptr;
+using std::vector;
+
+typedef struct {
+  uint64_t frames;
+  // Blocks taken from the heap, in total and during the last frame. Once the
+  // arena knows how much a frame needs this stops growing
+  uint64_t heap_allocations;
+  uint64_t frame_heap_allocations;
+  // Bytes handed out during the last frame, and the most in any frame
+  size_t frame_bytes;
+  size_t peak_bytes;
+  size_t capacity;
+} arena_stats_t;
+
+// Returns how many times the calling thread has allocated with new so far,
+// in the arena or not, to see what a frame takes from the heap. Memory C
+// libraries allocate with malloc isn't counted
+uint64_t HeapAllocations();
+
+// Memory for what only lives while a frame is drawn. Allocating is bumping a
+// pointer and nothing is freed until Reset, at the start of the next frame.
+// When a frame needs more than a block, another one is taken from the heap,
+// and the next Reset replaces them all with a single block big enough for
+// the whole frame, so that a steady stream of similar frames doesn't touch
+// the heap at all.
+class FrameArena {
+ public:
+  explicit FrameArena(size_t initial_size);
+
+  // Start a frame, everything allocated before is invalidated
+  void Reset();
+  // Returns uninitialized memory, valid until the next Reset
+  void *Allocate(size_t size, size_t alignment);
+  template <typename T>
+  T *Allocate(size_t count) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "Nothing allocated in the arena is destroyed");
+    return static_cast<T *>(Allocate(count * sizeof(T), alignof(T)));
+  }
+
+  arena_stats_t GetStats() const;
+
+  // Disable copy
+  FrameArena(const FrameArena &) = delete;
+  // Disable move
+  FrameArena &operator=(const FrameArena &) = delete;
+
+ private:
+  // The block being allocated from is the last one
+  vector<unique_ptr<unsigned char[]>> blocks_;
+  vector<size_t> block_sizes_;
+  size_t used_ = 0;
+  arena_stats_t stats_;
+
+  void AddBlock(size_t size);
+};
+
+// A growable array of trivially copyable elements living in a FrameArena.
+// Growing leaves the old elements behind in the arena, which is fine since
+// they are all dropped at the end of the frame anyway
+template <typename T>
+class ArenaVector {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Elements are moved around with memcpy");
+
+ public:
+  explicit ArenaVector(FrameArena *arena) : arena_(arena) {}
+
+  void push_back(const T &value) { insert_back(1, value); }
+  // Appends count copies of value
+  void insert_back(size_t count, const T &value) {
+    if (size_ + count > capacity_) Grow(size_ + count);
+    for (size_t i = 0; i < count; i++) data_[size_++] = value;
+  }
+  void clear() { size_ = 0; }
+
+  T *data() { return data_; }
+  const T *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  T &operator[](size_t i) {
+    assert(i < size_);
+    return data_[i];
+  }
+  const T &operator[](size_t i) const {
+    assert(i < size_);
+    return data_[i];
+  }
+
+ private:
+  FrameArena *arena_;
+  T *data_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+
+  void Grow(size_t min_capacity) {
+    size_t capacity = capacity_ == 0 ? 64 : capacity_ * 2;
+    while (capacity < min_capacity) capacity *= 2;
+
+    T *data = arena_->Allocate<T>(capacity);
+    if (size_ > 0) memcpy(data, data_, size_ * sizeof(T));
+    data_ = data;
+    capacity_ = capacity;
+  }
+};
+
+}  // namespace frame_arena
+
+#endif  // SRC_FRAME_ARENA_H_
@@ -0,0 +1,247 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./gzip_index.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace gzip_index {
+using std::lock_guard;
+
+// Distance, in decompressed bytes, between two checkpoints
+static const size_t kSpan = 4 << 20;
+// Deflate back-references reach at most 32K behind
+static const size_t kWindowSize = 32 << 10;
+static const size_t kCachedBlocks = 8;
+// Automatic detection of the gzip or zlib header
+static const int kWindowBitsAuto = 15 + 32;
+static const int kWindowBitsRaw = -15;
+// A gzip member ends with a CRC32 and the size of its content
+static const size_t kGzipTrailerSize = 8;
+
+// zlib takes at most UINT_MAX bytes of input at a time
+static void FeedInput(z_stream *strm, const unsigned char *data, size_t size,
+                      size_t *fed) {
+  if (strm->avail_in == 0 && *fed < size) {
+    size_t length = std::min(size - *fed, static_cast<size_t>(UINT_MAX));
+    strm->next_in = const_cast<unsigned char *>(data + *fed);
+    strm->avail_in = length;
+    *fed += length;
+  }
+}
+
+GzipIndex::GzipIndex(const unsigned char *data, size_t size)
+    : data_(data), size_(size) {}
+
+void GzipIndex::Build(const OutputCallback &on_output) {
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, kWindowBitsAuto) != Z_OK) {
+    fprintf(stderr, "Could not initialize zlib\n");
+    exit(EXIT_FAILURE);
+  }
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    checkpoints_.push_back({0, 0, 0, true, {}});
+  }
+
+  // Output goes round and round this buffer, so that it always holds the
+  // window needed by the next checkpoint
+  vector<unsigned char> window(kWindowSize, 0);
+  size_t fed = 0, total_in = 0, total_out = 0, last_checkpoint = 0;
+
+  for (;;) {
+    if (strm.avail_out == 0) {
+      strm.next_out = window.data();
+      strm.avail_out = kWindowSize;
+    }
+    FeedInput(&strm, data_, size_, &fed);
+    // A truncated file, show what we've got
+    if (strm.avail_in == 0) break;
+
+    unsigned char *out = strm.next_out;
+    unsigned int avail_in = strm.avail_in;
+    // Stop at the end of each deflate block, where checkpoints can be made
+    int ret = inflate(&strm, Z_BLOCK);
+    size_t produced = strm.next_out - out;
+    total_in += avail_in - strm.avail_in;
+
+    if (produced > 0) {
+      if (!on_output(reinterpret_cast<const char *>(out), produced, total_out,
+                     total_in)) {
+        break;
+      }
+      total_out += produced;
+    }
+
+    if (ret == Z_STREAM_END) {
+      // Another gzip member may follow, which can be started from its header
+      if (total_in == size_) break;
+      inflateReset(&strm);
+      if (total_out - last_checkpoint >= kSpan) {
+        lock_guard<mutex> lock(mutex_);
+        checkpoints_.push_back({total_in, total_out, 0, true, {}});
+        last_checkpoint = total_out;
+      }
+      continue;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      fprintf(stderr, "Compressed file is corrupted after %zu bytes\n",
+              total_out);
+      break;
+    }
+
+    // At the end of a block which is not the last one of the member
+    bool block_boundary = (strm.data_type & 128) && !(strm.data_type & 64);
+    if (block_boundary && total_out - last_checkpoint >= kSpan) {
+      checkpoint_t checkpoint{total_in, total_out, strm.data_type & 7, false,
+                              vector<unsigned char>(kWindowSize)};
+      // The oldest bytes are the ones after the write position
+      size_t written = kWindowSize - strm.avail_out;
+      memcpy(checkpoint.window.data(), window.data() + written,
+             kWindowSize - written);
+      memcpy(checkpoint.window.data() + kWindowSize - written, window.data(),
+             written);
+
+      lock_guard<mutex> lock(mutex_);
+      checkpoints_.push_back(std::move(checkpoint));
+      last_checkpoint = total_out;
+    }
+  }
+
+  inflateEnd(&strm);
+}
+
+void GzipIndex::Inflate(const checkpoint_t &checkpoint, size_t end,
+                        vector<char> *text) const {
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  size_t fed = checkpoint.in;
+  // Only until the end of the member of the checkpoint, the members after
+  // it are inflated from their header
+  bool raw = !checkpoint.member_start;
+  // Of the trailer of the member, which can be split between two inputs
+  size_t trailer_left = 0;
+
+  if (checkpoint.member_start) {
+    if (inflateInit2(&strm, kWindowBitsAuto) != Z_OK) {
+      fprintf(stderr, "Could not initialize zlib\n");
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    if (inflateInit2(&strm, kWindowBitsRaw) != Z_OK) {
+      fprintf(stderr, "Could not initialize zlib\n");
+      exit(EXIT_FAILURE);
+    }
+    // The block starts in the middle of a byte
+    if (checkpoint.bits > 0) {
+      inflatePrime(&strm, checkpoint.bits,
+                   data_[checkpoint.in - 1] >> (8 - checkpoint.bits));
+    }
+    inflateSetDictionary(&strm, checkpoint.window.data(), kWindowSize);
+  }
+
+  text->resize(end - checkpoint.out);
+  size_t produced = 0;
+  while (produced < text->size()) {
+    strm.next_out = reinterpret_cast<unsigned char *>(text->data() + produced);
+    strm.avail_out = std::min(text->size() - produced,
+                              static_cast<size_t>(UINT_MAX));
+    FeedInput(&strm, data_, size_, &fed);
+    if (strm.avail_in == 0) break;
+
+    if (trailer_left > 0) {
+      size_t skipped =
+          std::min(trailer_left, static_cast<size_t>(strm.avail_in));
+      strm.next_in += skipped;
+      strm.avail_in -= skipped;
+      trailer_left -= skipped;
+      continue;
+    }
+
+    unsigned int avail_out = strm.avail_out;
+    int ret = inflate(&strm, Z_NO_FLUSH);
+    produced += avail_out - strm.avail_out;
+
+    if (ret == Z_STREAM_END) {
+      // A raw stream leaves the gzip trailer to us, a gzip one reads it
+      if (raw) {
+        trailer_left = kGzipTrailerSize;
+        raw = false;
+      }
+      inflateReset2(&strm, kWindowBitsAuto);
+      continue;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) break;
+  }
+  text->resize(produced);
+
+  inflateEnd(&strm);
+}
+
+const GzipIndex::checkpoint_t *GzipIndex::FindCheckpoint(
+    size_t offset, size_t *next_out) const {
+  lock_guard<mutex> lock(mutex_);
+  auto it = std::upper_bound(
+      checkpoints_.begin(), checkpoints_.end(), offset,
+      [](size_t out, const checkpoint_t &c) { return out < c.out; });
+  assert(it != checkpoints_.begin());
+  *next_out = it != checkpoints_.end() ? it->out : 0;
+  return &*(--it);
+}
+
+const char *GzipIndex::LoadBlock(size_t begin, size_t end,
+                                 vector<block_t> *blocks, uint64_t reads) {
+  // The block begins at the nearest checkpoint before the text
+  size_t block_end;
+  const checkpoint_t *checkpoint = FindCheckpoint(begin, &block_end);
+  // Blocks span to the next checkpoint, or further if the text crosses it
+  block_end = std::max({end, block_end, checkpoint->out + kSpan});
+
+  // A block which is too short, for text which crosses into the next one,
+  // is left alone for the pointers into it, and the text is inflated in
+  // another block
+  block_t *block = nullptr;
+  for (auto &b : *blocks) {
+    if (b.checkpoint == checkpoint && b.text.size() >= end - checkpoint->out) {
+      block = &b;
+    }
+  }
+
+  if (block == nullptr) {
+    if (blocks->size() < kCachedBlocks) {
+      blocks->push_back({checkpoint, {}, 0});
+      block = &blocks->back();
+    } else {
+      block = &*std::min_element(blocks->begin(), blocks->end(),
+                                 [](const block_t &a, const block_t &b) {
+                                   return a.last_used < b.last_used;
+                                 });
+      block->checkpoint = checkpoint;
+    }
+    Inflate(*checkpoint, block_end, &block->text);
+    assert(block->text.size() >= end - checkpoint->out);
+  }
+
+  block->last_used = reads;
+  return block->text.data() + (begin - checkpoint->out);
+}
+
+const char *GzipIndex::Read(size_t begin, size_t end) {
+  reads_++;
+  return LoadBlock(begin, end, &blocks_, reads_);
+}
+
+void GzipIndex::Copy(size_t begin, size_t end, string *text) {
+  lock_guard<mutex> lock(copy_mutex_);
+  copies_++;
+  text->assign(LoadBlock(begin, end, &copied_blocks_, copies_), end - begin);
+}
+
+}  // namespace gzip_index
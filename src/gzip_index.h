@@ -0,0 +1,105 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_GZIP_INDEX_H_
+#define SRC_GZIP_INDEX_H_
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace gzip_index {
+using std::deque;
+using std::function;
+using std::mutex;
+using std::string;
+using std::vector;
+
+// Called with each piece of decompressed text, its offset in the
+// decompressed stream and how many compressed bytes have been consumed so
+// far. Returning false stops the decompression
+using OutputCallback =
+    function<bool(const char *text, size_t length, size_t offset,
+                  size_t consumed)>;
+
+// Random access into a gzip file. A single pass over the whole stream
+// records an inflate checkpoint every few MB of output, so that any offset
+// can later be reached by decompressing from the nearest checkpoint only.
+// The decompressed text around recently read offsets is kept in a small LRU
+// cache of blocks.
+class GzipIndex {
+ public:
+  GzipIndex(const unsigned char *data, size_t size);
+
+  // Decompress the whole stream once, recording checkpoints. Can run on a
+  // background thread while Read is used on another one
+  void Build(const OutputCallback &on_output);
+
+  // Returns the decompressed bytes [begin, end), which must have been
+  // produced by Build already. The pointer stays valid until kCachedBlocks
+  // other blocks have been read
+  const char *Read(size_t begin, size_t end);
+  // Like Read, but copies the bytes in text, from blocks of its own so that
+  // it doesn't evict the ones Read returned. Can be used on any number of
+  // other threads than the one using Read
+  void Copy(size_t begin, size_t end, string *text);
+
+  // Disable copy
+  GzipIndex(const GzipIndex &) = delete;
+  // Disable move
+  GzipIndex &operator=(const GzipIndex &) = delete;
+
+ private:
+  // The state needed to restart inflate at a deflate block boundary
+  typedef struct {
+    // Offset in the compressed data of the first full byte of the block
+    size_t in;
+    // Offset in the decompressed stream
+    size_t out;
+    // Bits of the block in the byte before `in`
+    int bits;
+    // At the beginning of a gzip member inflate starts from its header
+    // instead, without a dictionary
+    bool member_start;
+    // The last 32K of output before this point
+    vector<unsigned char> window;
+  } checkpoint_t;
+
+  // Decompressed text starting at a checkpoint
+  typedef struct {
+    const checkpoint_t *checkpoint;
+    vector<char> text;
+    uint64_t last_used;
+  } block_t;
+
+  const unsigned char *data_;
+  size_t size_;
+
+  // Guards checkpoints_, which Build appends to. A deque never moves its
+  // elements, so checkpoints can be used after the lock is released
+  mutable mutex mutex_;
+  deque<checkpoint_t> checkpoints_;
+
+  vector<block_t> blocks_;
+  uint64_t reads_ = 0;
+
+  // Guards copied_blocks_ and copies_
+  mutex copy_mutex_;
+  vector<block_t> copied_blocks_;
+  uint64_t copies_ = 0;
+
+  // Returns the nearest checkpoint before the offset, and sets next_out to
+  // the offset of the one after it, or 0 if it's the last one
+  const checkpoint_t *FindCheckpoint(size_t offset, size_t *next_out) const;
+  // Returns the bytes [begin, end) from one of the blocks, decompressing
+  // them in the least recently used one if none has them
+  const char *LoadBlock(size_t begin, size_t end, vector<block_t> *blocks,
+                        uint64_t reads);
+  void Inflate(const checkpoint_t &checkpoint, size_t end,
+               vector<char> *text) const;
+};
+
+}  // namespace gzip_index
+
+#endif  // SRC_GZIP_INDEX_H_
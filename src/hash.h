@@ -0,0 +1,46 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_HASH_H_
+#define SRC_HASH_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace hash {
+using std::string_view;
+
+// The finalizer of MurmurHash3, every bit of the input affects every bit of
+// the output
+inline uint64_t Mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// A fast 64-bit hash of some text, 8 bytes at a time. Not meant to resist
+// collisions crafted on purpose, users compare the text when it matters
+inline uint64_t Hash(string_view text) {
+  const uint64_t kMultiplier = 0x9e3779b97f4a7c15ULL;
+  uint64_t h = text.size() * kMultiplier;
+
+  size_t i = 0;
+  for (; i + 8 <= text.size(); i += 8) {
+    uint64_t word;
+    memcpy(&word, text.data() + i, 8);
+    h = (h ^ Mix(word)) * kMultiplier;
+  }
+  if (i < text.size()) {
+    uint64_t word = 0;
+    memcpy(&word, text.data() + i, text.size() - i);
+    h = (h ^ Mix(word)) * kMultiplier;
+  }
+
+  return Mix(h);
+}
+
+}  // namespace hash
+
+#endif  // SRC_HASH_H_
@@ -0,0 +1,340 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./highlighter.h"
+
+#include <algorithm>
+
+namespace highlighter {
+
+// How far apart checkpoints are, in lines
+static const size_t kCheckpointLines = 256;
+// How many checkpoints up to look for an exact one before guessing
+static const size_t kMaxCheckpointsBack = 16;
+// How far above a line to start lexing when guessing its state
+static const size_t kResyncLines = 256;
+// Past this lines are left plain, and their state at the end is the one
+// they were cut in
+static const size_t kMaxLexedLineLength = 64 << 10;
+// Lines lexed, with their tokens, kept at most. Enough for walking down from
+// the farthest checkpoint a few times over. When there are more, the ones
+// further than a quarter of it from the line being lexed are dropped
+static const size_t kMaxCachedLines = 16 << 10;
+
+// The states of the lexer at the end of a line
+static const uint8_t kNormal = 0;
+static const uint8_t kInComment = 1;
+
+// How much to trust a checkpoint
+static const uint8_t kUnknown = 0;
+// Found lexing from a guess
+static const uint8_t kGuessed = 1;
+// Exact before an edit above it, and likely still right
+static const uint8_t kStale = 2;
+static const uint8_t kExact = 3;
+
+// Both sorted, to be binary searched
+static const string_view kKeywords[] = {
+    "alignas", "alignof", "asm", "auto", "break", "case", "catch", "class",
+    "const", "const_cast", "constexpr", "continue", "decltype", "default",
+    "delete", "do", "dynamic_cast", "else", "enum", "explicit", "export",
+    "extern", "false", "for", "friend", "goto", "if", "inline", "mutable",
+    "namespace", "new", "noexcept", "nullptr", "operator", "private",
+    "protected", "public", "register", "reinterpret_cast", "return", "sizeof",
+    "static", "static_assert", "static_cast", "struct", "switch", "template",
+    "this", "throw", "true", "try", "typedef", "typeid", "typename", "union",
+    "using", "virtual", "volatile", "while"};
+static const string_view kTypes[] = {
+    "bool", "char", "char16_t", "char32_t", "double", "float", "int", "int16_t",
+    "int32_t", "int64_t", "int8_t", "ivec2", "long", "mat4", "short", "signed",
+    "size_t", "ssize_t", "uint16_t", "uint32_t", "uint64_t", "uint8_t",
+    "unsigned", "uvec2", "vec2", "vec3", "vec4", "void", "wchar_t"};
+
+// C and C++, and the shaders, which look like them
+static const string_view kExtensions[] = {
+    ".c", ".cc", ".cpp", ".cxx", ".h", ".hh", ".hpp", ".hxx", ".glsl", ".vert",
+    ".frag"};
+
+static bool EndsWith(string_view text, string_view suffix) {
+  return text.size() >= suffix.size() &&
+         text.substr(text.size() - suffix.size()) == suffix;
+}
+
+static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+// Bytes of UTF-8 sequences are part of identifiers, so that they aren't
+// split
+static bool IsIdentifier(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || IsDigit(c) ||
+         c == '_' || static_cast<unsigned char>(c) >= 0x80;
+}
+
+// Append the tokens of the line to tokens, and return the state at its end
+static uint8_t LexLine(string_view text, uint8_t state,
+                       vector<token_t> *tokens) {
+  text = text.substr(0, kMaxLexedLineLength);
+  auto add = [&](size_t start, size_t end, uint8_t kind) {
+    tokens->push_back(token_t{static_cast<uint32_t>(start),
+                              static_cast<uint32_t>(end - start), kind});
+  };
+
+  size_t i = 0;
+  if (state == kInComment) {
+    size_t end = text.find("*/");
+    if (end == string_view::npos) {
+      if (!text.empty()) add(0, text.size(), kComment);
+      return kInComment;
+    }
+    i = end + 2;
+    add(0, i, kComment);
+  }
+
+  bool first = true;
+  while (i < text.size()) {
+    char c = text[i];
+    char next = i + 1 < text.size() ? text[i + 1] : '\0';
+    size_t start = i;
+
+    if (c == ' ' || c == '\t' || c == '\r') {
+      i++;
+      continue;
+    }
+
+    if (c == '#' && first) {
+      // Only the directive, what follows it is lexed as usual
+      i++;
+      while (i < text.size() && (text[i] == ' ' || text[i] == '\t')) i++;
+      while (i < text.size() && IsIdentifier(text[i])) i++;
+      add(start, i, kPreprocessor);
+    } else if (c == '/' && next == '/') {
+      add(start, text.size(), kComment);
+      return kNormal;
+    } else if (c == '/' && next == '*') {
+      size_t end = text.find("*/", i + 2);
+      if (end == string_view::npos) {
+        add(start, text.size(), kComment);
+        return kInComment;
+      }
+      i = end + 2;
+      add(start, i, kComment);
+    } else if (c == '"' || c == '\'') {
+      // Up to the closing quote which isn't escaped, or the end of the line
+      i++;
+      while (i < text.size() && text[i] != c) {
+        i += text[i] == '\\' ? 2 : 1;
+      }
+      i = std::min(i + 1, text.size());
+      add(start, i, kString);
+    } else if (IsDigit(c) || (c == '.' && IsDigit(next))) {
+      while (i < text.size() &&
+             (IsIdentifier(text[i]) || text[i] == '.' || text[i] == '\'')) {
+        i++;
+      }
+      add(start, i, kNumber);
+    } else if (IsIdentifier(c)) {
+      while (i < text.size() && IsIdentifier(text[i])) i++;
+      string_view word = text.substr(start, i - start);
+      if (std::binary_search(std::begin(kKeywords), std::end(kKeywords),
+                             word)) {
+        add(start, i, kKeyword);
+      } else if (std::binary_search(std::begin(kTypes), std::end(kTypes),
+                                    word)) {
+        add(start, i, kType);
+      }
+    } else {
+      i++;
+    }
+    first = false;
+  }
+  return kNormal;
+}
+
+Highlighter::Highlighter(const Document *document, const string &path)
+    : document_(document), enabled_(false) {
+  for (auto extension : kExtensions) {
+    enabled_ = enabled_ || EndsWith(path, extension);
+  }
+  Reset();
+}
+
+bool Highlighter::IsEnabled() const { return enabled_; }
+
+void Highlighter::Reset() {
+  lines_.clear();
+  // The first line starts from scratch
+  checkpoints_.assign(1, checkpoint_t{kNormal, kExact});
+  chain_first_ = chain_end_ = 0;
+}
+
+highlighter_stats_t Highlighter::GetStats() const {
+  return highlighter_stats_t{lexed_lines_, lines_.size(),
+                             checkpoints_.size()};
+}
+
+const vector<token_t> &Highlighter::GetTokens(size_t line) {
+  return Walk(line).tokens;
+}
+
+void Highlighter::Prefetch(size_t line) {
+  size_t lines = document_->LineCount();
+  if (!enabled_ || lines == 0) return;
+  Walk(std::min(line, lines - 1));
+}
+
+void Highlighter::Splice(size_t line, size_t removed, size_t added) {
+  if (!enabled_) return;
+
+  // The checkpoints up to the line are of the lines above it, which didn't
+  // change
+  size_t first = line / kCheckpointLines + 1;
+  if (removed == added) {
+    // Lines below the edit most likely start in the same state as before,
+    // which is checked once they are lexed down to again
+    for (size_t i = first; i < checkpoints_.size(); i++) {
+      if (checkpoints_[i].accuracy == kExact) {
+        checkpoints_[i].accuracy = kStale;
+      }
+    }
+  } else if (first < checkpoints_.size()) {
+    // The lines moved, and with them their checkpoints
+    checkpoints_.resize(first);
+  }
+
+  // The lines from the edit on have to be lexed again
+  chain_end_ = std::max(chain_first_, std::min(chain_end_, line));
+}
+
+const Highlighter::line_t &Highlighter::Lex(size_t line, uint8_t state) {
+  uint64_t hash = document_->GetLineHash(line);
+  auto it = lines_.find(line);
+  if (it != lines_.end() && it->second.hash == hash &&
+      it->second.start_state == state) {
+    return it->second;
+  }
+
+  if (lines_.size() >= kMaxCachedLines) {
+    // Keep the lines around the one being lexed, which are the ones around
+    // the screen
+    for (auto cached = lines_.begin(); cached != lines_.end();) {
+      size_t distance =
+          cached->first > line ? cached->first - line : line - cached->first;
+      if (distance > kMaxCachedLines / 4) {
+        cached = lines_.erase(cached);
+      } else {
+        cached++;
+      }
+    }
+  }
+
+  line_t &entry = lines_[line];
+  entry.hash = hash;
+  entry.start_state = state;
+  entry.tokens.clear();
+  entry.end_state = LexLine(document_->GetLine(line), state, &entry.tokens);
+  lexed_lines_++;
+  return entry;
+}
+
+void Highlighter::Reconcile(size_t checkpoint, uint8_t state, bool exact) {
+  if (checkpoint >= checkpoints_.size()) {
+    checkpoints_.resize(checkpoint + 1, checkpoint_t{kNormal, kUnknown});
+  }
+
+  checkpoint_t &current = checkpoints_[checkpoint];
+  if (!exact) {
+    if (current.accuracy == kUnknown) {
+      current = checkpoint_t{state, kGuessed};
+    }
+    return;
+  }
+
+  // The edit above didn't change the state here, so nothing below it
+  // changed either
+  if (current.accuracy == kStale && current.state == state) {
+    for (size_t i = checkpoint;
+         i < checkpoints_.size() && checkpoints_[i].accuracy == kStale; i++) {
+      checkpoints_[i].accuracy = kExact;
+    }
+    return;
+  }
+  current = checkpoint_t{state, kExact};
+}
+
+const Highlighter::line_t &Highlighter::Walk(size_t line) {
+  size_t checkpoint = line / kCheckpointLines;
+  if (checkpoint >= checkpoints_.size()) {
+    checkpoints_.resize(checkpoint + 1, checkpoint_t{kNormal, kUnknown});
+  }
+
+  // Lex from the closest exact checkpoint if it's close enough, otherwise
+  // from a guess
+  size_t exact_checkpoint = checkpoint;
+  while (exact_checkpoint > 0 &&
+         checkpoints_[exact_checkpoint].accuracy != kExact &&
+         checkpoint - exact_checkpoint < kMaxCheckpointsBack) {
+    exact_checkpoint--;
+  }
+
+  size_t current;
+  uint8_t state;
+  bool exact;
+  if (checkpoints_[exact_checkpoint].accuracy == kExact) {
+    current = exact_checkpoint * kCheckpointLines;
+    state = checkpoints_[exact_checkpoint].state;
+    exact = true;
+  } else if (checkpoints_[checkpoint].accuracy != kUnknown) {
+    current = checkpoint * kCheckpointLines;
+    state = checkpoints_[checkpoint].state;
+    exact = false;
+  } else {
+    current = line > kResyncLines ? line - kResyncLines : 0;
+    state = kNormal;
+    exact = current == 0;
+  }
+
+  // The lines walked through last are ready, and carrying on from the last
+  // of them is quicker, as long as they are as accurate
+  bool chained = chain_first_ < chain_end_ && (chain_exact_ || !exact);
+  if (chained && chain_first_ <= line && line < chain_end_) {
+    auto cached = lines_.find(line);
+    if (cached != lines_.end()) {
+      return Lex(line, cached->second.start_state);
+    }
+  }
+  bool extended = false;
+  if (chained && chain_end_ <= line && chain_end_ >= current) {
+    auto cached = lines_.find(chain_end_ - 1);
+    if (cached != lines_.end()) {
+      state = Lex(chain_end_ - 1, cached->second.start_state).end_state;
+      current = chain_end_;
+      exact = chain_exact_;
+      extended = true;
+    }
+  }
+
+  size_t first = current;
+  for (; current < line; current++) {
+    if (current % kCheckpointLines == 0) {
+      Reconcile(current / kCheckpointLines, state, exact);
+    }
+    state = Lex(current, state).end_state;
+  }
+  if (line % kCheckpointLines == 0) {
+    Reconcile(line / kCheckpointLines, state, exact);
+  }
+
+  // Exact walks give the same states, so one which reaches the lines walked
+  // through before joins them
+  if (extended) {
+    chain_end_ = line + 1;
+  } else if (exact && chain_exact_ && chain_first_ < chain_end_ &&
+             first <= chain_first_ && chain_first_ <= line + 1) {
+    chain_first_ = first;
+    chain_end_ = std::max(chain_end_, line + 1);
+  } else {
+    chain_first_ = first;
+    chain_end_ = line + 1;
+    chain_exact_ = exact;
+  }
+  return Lex(line, state);
+}
+
+}  // namespace highlighter
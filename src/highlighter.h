@@ -0,0 +1,122 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_HIGHLIGHTER_H_
+#define SRC_HIGHLIGHTER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "./document.h"
+
+namespace highlighter {
+using document::Document;
+using std::string;
+using std::string_view;
+using std::unordered_map;
+using std::vector;
+
+// What a piece of text is, which decides its color
+static const uint8_t kPlain = 0;
+static const uint8_t kKeyword = 1;
+static const uint8_t kType = 2;
+static const uint8_t kComment = 3;
+static const uint8_t kString = 4;
+static const uint8_t kNumber = 5;
+static const uint8_t kPreprocessor = 6;
+static const uint8_t kTokenKinds = 7;
+
+// A piece of a line which isn't plain text, in bytes from the start of the
+// line
+typedef struct {
+  uint32_t start;
+  uint32_t length;
+  uint8_t kind;
+} token_t;
+
+typedef struct {
+  uint64_t lexed_lines;
+  size_t cached_lines;
+  size_t checkpoints;
+} highlighter_stats_t;
+
+// Splits lines of C-like code in tokens. A line is lexed from the state the
+// lexer was in at the end of the line before, which is all it needs to know
+// about the lines above it, so each line is kept with the state at its start
+// and at its end. Lines are only lexed when they are drawn, or are about to
+// be, and lexed again only when they or their state at the start change:
+// after an edit the lines below it are found in the cache as soon as their
+// state is the same as before, which stops the edit from going any further.
+// The state at the start of every few lines is kept as a checkpoint, so that
+// getting to a line only takes lexing from the closest one above it. When
+// there is none close enough, like after jumping far into the file, lexing
+// starts a bit above the line from the state most lines start in, and what
+// is found on the way is kept as a guess until it's checked by lexing down
+// to it from an exact checkpoint. The lines walked through last are kept
+// track of, so that drawing the same lines again, or the ones after them,
+// doesn't walk down from a checkpoint every frame.
+class Highlighter {
+ public:
+  // Files which don't have the extension of C-like code aren't highlighted
+  Highlighter(const Document *document, const string &path);
+
+  bool IsEnabled() const;
+  // Returns the tokens of the line, in order. Valid until the next call
+  const vector<token_t> &GetTokens(size_t line);
+  // Lex up to the line, so that scrolling to it finds it ready
+  void Prefetch(size_t line);
+  // Follow an edit which replaced `removed` lines starting at `line` with
+  // `added` new ones. The checkpoints below it are checked again
+  void Splice(size_t line, size_t removed, size_t added);
+  // Forget everything, for when the document was replaced
+  void Reset();
+  highlighter_stats_t GetStats() const;
+
+  // Disable copy
+  Highlighter(const Highlighter &) = delete;
+  // Disable move
+  Highlighter &operator=(const Highlighter &) = delete;
+
+ private:
+  typedef struct {
+    // Of the text of the line, see Document::GetLineHash
+    uint64_t hash;
+    uint8_t start_state;
+    uint8_t end_state;
+    vector<token_t> tokens;
+  } line_t;
+
+  typedef struct {
+    uint8_t state;
+    uint8_t accuracy;
+  } checkpoint_t;
+
+  const Document *document_;
+  bool enabled_;
+  // By line, the lines whose text or start state changed since are lexed
+  // again
+  unordered_map<size_t, line_t> lines_;
+  // The state at the start of every kCheckpointLines lines
+  vector<checkpoint_t> checkpoints_;
+  // The lines [chain_first_, chain_end_) were lexed one after the other by
+  // the last walks, so their states at the start in lines_ are as accurate
+  // as the checkpoint they were lexed from, unless they were evicted
+  size_t chain_first_ = 0;
+  size_t chain_end_ = 0;
+  bool chain_exact_ = false;
+  uint64_t lexed_lines_ = 0;
+
+  // Returns the line lexed from its state at the start, from the cache if
+  // it's there
+  const line_t &Lex(size_t line, uint8_t state);
+  // Returns the line, lexing the lines above it from the closest checkpoint
+  const line_t &Walk(size_t line);
+  // Update the checkpoint with the state found lexing down to it
+  void Reconcile(size_t checkpoint, uint8_t state, bool exact);
+};
+
+}  // namespace highlighter
+
+#endif  // SRC_HIGHLIGHTER_H_
@@ -0,0 +1,124 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./line_indexer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <thread>
+
+namespace line_indexer {
+using std::thread;
+
+// Chunks smaller than this are not worth a thread
+static const size_t kMinChunkSize = 4 << 20;
+
+static void FindLineStartsScalar(const char *data, size_t begin, size_t end,
+                                 size_t base, vector<size_t> *line_starts) {
+  for (size_t i = begin; i < end; i++) {
+    if (data[i] == '\n') line_starts->push_back(base + i + 1);
+  }
+}
+
+#if defined(__SSE2__)
+static size_t FindLineStartsSSE2(const char *data, size_t size, size_t base,
+                                 vector<size_t> *line_starts) {
+  const __m128i newline = _mm_set1_epi8('\n');
+
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    unsigned int mask =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+    while (mask != 0) {
+      line_starts->push_back(base + i + __builtin_ctz(mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t FindLineStartsAVX2(
+    const char *data, size_t size, size_t base, vector<size_t> *line_starts) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    unsigned int mask = static_cast<unsigned int>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline)));
+    while (mask != 0) {
+      line_starts->push_back(base + i + __builtin_ctz(mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+  return i;
+}
+#endif
+
+void FindLineStarts(const char *data, size_t size, size_t base,
+                    vector<size_t> *line_starts) {
+  size_t scanned = 0;
+#if defined(__SSE2__)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2) {
+    scanned = FindLineStartsAVX2(data, size, base, line_starts);
+  } else {
+    scanned = FindLineStartsSSE2(data, size, base, line_starts);
+  }
+#endif
+  // Whatever is left over from the vectorized loop
+  FindLineStartsScalar(data, scanned, size, base, line_starts);
+}
+
+void FindLineStartsParallel(const char *data, size_t size, size_t base,
+                            vector<size_t> *line_starts) {
+  size_t threads_count =
+      std::max(1u, std::thread::hardware_concurrency());
+  threads_count = std::min(threads_count, size / kMinChunkSize + 1);
+
+  if (threads_count == 1) {
+    FindLineStarts(data, size, base, line_starts);
+    return;
+  }
+
+  // Every chunk collects its own offsets...
+  size_t chunk_size = (size + threads_count - 1) / threads_count;
+  vector<vector<size_t>> chunk_line_starts(threads_count);
+  {
+    vector<thread> threads;
+    for (size_t i = 0; i < threads_count; i++) {
+      size_t begin = std::min(i * chunk_size, size);
+      size_t end = std::min(begin + chunk_size, size);
+      threads.emplace_back(FindLineStarts, data + begin, end - begin,
+                           base + begin, &chunk_line_starts[i]);
+    }
+    for (auto &t : threads) t.join();
+  }
+
+  // ...then a prefix sum over the chunks' counts tells each chunk where its
+  // offsets go in the merged index
+  vector<size_t> destinations(threads_count);
+  size_t total = line_starts->size();
+  for (size_t i = 0; i < threads_count; i++) {
+    destinations[i] = total;
+    total += chunk_line_starts[i].size();
+  }
+  line_starts->resize(total);
+
+  {
+    vector<thread> threads;
+    for (size_t i = 0; i < threads_count; i++) {
+      threads.emplace_back([&, i]() {
+        std::copy(chunk_line_starts[i].begin(), chunk_line_starts[i].end(),
+                  line_starts->begin() + destinations[i]);
+      });
+    }
+    for (auto &t : threads) t.join();
+  }
+}
+
+}  // namespace line_indexer
@@ -0,0 +1,25 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_LINE_INDEXER_H_
+#define SRC_LINE_INDEXER_H_
+
+#include <cstddef>
+#include <vector>
+
+namespace line_indexer {
+using std::vector;
+
+// Append to line_starts the offset of the byte following each '\n' in
+// [data, data + size), shifted by base. Only '\n' is searched for, a "\r\n"
+// pair is recognized later when the line is read, so a chunk boundary falling
+// between the two bytes doesn't matter.
+void FindLineStarts(const char *data, size_t size, size_t base,
+                    vector<size_t> *line_starts);
+
+// Same as FindLineStarts, but the range is split into chunks which are
+// scanned on all of the available cores and then merged in order
+void FindLineStartsParallel(const char *data, size_t size, size_t base,
+                            vector<size_t> *line_starts);
+
+}  // namespace line_indexer
+
+#endif  // SRC_LINE_INDEXER_H_
@@ -21,7 +21,9 @@
 // HarfBuzz FreeTpe
 #include <harfbuzz/hb-ft.h>
 
-#include <fstream>
+#include <cinttypes>
+#include <cstring>
+#include <memory>
 #include <unordered_map>
 #include <vector>
 
@@ -32,31 +34,48 @@
 
 #include "./callbacks.h"
 #include "./constants.h"
+#include "./document.h"
+#include "./editor.h"
+#include "./file_watcher.h"
+#include "./frame_arena.h"
+#include "./highlighter.h"
 #include "./renderer.h"
+#include "./search.h"
 #include "./shader.h"
 #include "./state.h"
 #include "./texture_atlas.h"
+#include "./trigram_index.h"
 #include "./util.h"
 #include "./window.h"
+#include "./wrap_index.h"
 
 namespace lettera {
+using document::Document;
+using editor::Editor;
+using editor::edit_t;
 using face_collection::FaceCollection;
+using face_collection::FaceCoverage;
+using face_collection::LoadCoverage;
 using face_collection::LoadFaces;
+using face_collection::UnloadFaces;
+using file_watcher::FileWatcher;
+using frame_arena::FrameArena;
+using highlighter::Highlighter;
 using renderer::Render;
-using shaping_cache::CodePointsFacePair;
+using renderer::ReshapeEditedLine;
+using search::Search;
+using search::match_t;
 using shaping_cache::ShapingCache;
 using state::State;
 using std::get;
 using std::make_pair;
-using std::make_tuple;
-using std::pair;
 using std::string;
-using std::tuple;
-using std::unordered_map;
+using std::unique_ptr;
 using std::vector;
-using texture_atlas::Character;
 using texture_atlas::TextureAtlas;
+using trigram_index::TrigramIndex;
 using window::Window;
+using wrap_index::WrapIndex;
 
 GLuint VAO, VBO;
 
@@ -72,10 +91,64 @@ void InitOpenGL() {
   glDebugMessageCallback(util::GLDebugMessageCallback, nullptr);
 }
 
-int main(int argc UNUSED, char **argv) {
+void UpdateWindowTitle(GLFWwindow *window, const char *file_name,
+                       const Document &document, const Search &search,
+                       bool finding) {
+  char title[512];
+  int length;
+  if (document.IsModified()) {
+    length = snprintf(title, sizeof(title), "%s - %s (modified) - %zu lines",
+                      kWindowTitle, file_name, document.LineCount());
+  } else if (document.IsIndexed()) {
+    length = snprintf(title, sizeof(title), "%s - %s - %zu lines",
+                      kWindowTitle, file_name, document.LineCount());
+  } else {
+    length = snprintf(title, sizeof(title),
+                      "%s - %s - ~%zu lines (indexing %.0f%%)", kWindowTitle,
+                      file_name, document.ApproximateLineCount(),
+                      document.IndexingProgress() * 100);
+  }
+
+  // The query is shown while it's typed in, and its matches are counted as
+  // they are found
+  if ((finding || search.IsActive()) &&
+      length < static_cast<int>(sizeof(title))) {
+    snprintf(title + length, sizeof(title) - length,
+             " - %s: %s%s (%zu matches%s)",
+             search.IsRegex() ? "find regex" : "find",
+             search.GetQuery().c_str(), finding ? "_" : "",
+             search.MatchCount(),
+             !search.IsValid() ? ", invalid"
+                               : search.IsDone() ? "" : ", searching");
+  }
+  glfwSetWindowTitle(window, title);
+}
+
+// Returns true when the jump is done, or there turned out to be no match to
+// jump to
+bool JumpToMatch(callbacks::glfw_user_pointer_t *obj, const Search &search,
+                 State *state, const WrapIndex &wrap_index) {
+  size_t line = state->GetStartLine(), column = 0;
+  if (obj->has_current_match) {
+    line = obj->current_match.line;
+    column = obj->current_match.column + (obj->jump > 0 ? 1 : 0);
+  }
+
+  match_t match;
+  bool found = obj->jump > 0 ? search.FindNext(line, column, &match)
+                             : search.FindPrevious(line, column, &match);
+  if (found) {
+    obj->current_match = match;
+    obj->has_current_match = true;
+    state->ShowLine(match.line, wrap_index);
+  }
+  return found || search.IsDone();
+}
+
+int main(const char *path, bool follow, bool index_trigrams) {
   Window window(kInitialWindowWidth, kInitialWindowHeight, kWindowTitle,
-                callbacks::KeyCallback, callbacks::ScrollCallback,
-                callbacks::ResizeCallback);
+                callbacks::KeyCallback, callbacks::CharCallback,
+                callbacks::ScrollCallback, callbacks::ResizeCallback);
   State state(kInitialWindowWidth, kInitialWindowHeight, kLineHeight,
               kInitialLine);
 
@@ -91,6 +164,10 @@ int main(int argc UNUSED, char **argv) {
   glfw_user_pointer.shader_program_id = shader.programId;
   glfw_user_pointer.state = &state;
 
+  // Rows of the soft wrapped lines, only used while wrapping is on
+  WrapIndex wrap_index;
+  glfw_user_pointer.wrap_index = &wrap_index;
+
   // https://stackoverflow.com/questions/48491340/use-rgb-texture-as-alpha-values-subpixel-font-rendering-in-opengl
   // TODO(andrea): understand WHY it works, and if this is an actual solution,
   // then write a blog post
@@ -128,23 +205,28 @@ int main(int argc UNUSED, char **argv) {
   // Set which filter to use for the LCD Subpixel Antialiasing
   FT_Library_SetLcdFilter(ft, FT_LCD_FILTER_DEFAULT);
 
-  // Read the file
-  vector<string> lines;
-  {
-    std::ifstream file(argv[1]);
-    std::string line;
-    while (std::getline(file, line)) {
-      lines.push_back(line);
-    }
-    assert(lines.size() > 0);
+  // Map the file and index it in the background, waking up the render loop
+  // every time more lines are available
+  Document document(path, glfwPostEmptyEvent);
+  // Only wait for the first screen, not for the whole file
+  document.WaitForLines(state.GetVisibleLines());
+  assert(document.HasLines(1));
+  glfw_user_pointer.document = &document;
+
+  // In follow mode the file is watched for appended lines, like tail -f
+  unique_ptr<FileWatcher> file_watcher;
+  bool file_changed = false;
+  if (follow) {
+    file_watcher.reset(new FileWatcher(path, glfwPostEmptyEvent));
   }
-  glfw_user_pointer.lines = &lines;
 
   // Load the fonts
   // TODO(andrea): make this support multiple fonts
   vector<string> face_names{"./assets/fonts/FiraCode-Retina.ttf",
                             "./assets/fonts/NotoColorEmoji.ttf"};
   FaceCollection faces = LoadFaces(ft, face_names);
+  // Which face to shape each codepoint with
+  FaceCoverage coverage = LoadCoverage(faces);
   // And the texture atlases
   TextureAtlas monochrome_texture_atlas(
       get<1>(faces[0]), get<2>(faces[0]), shader.programId,
@@ -156,30 +238,182 @@ int main(int argc UNUSED, char **argv) {
   texture_atlases.push_back(&monochrome_texture_atlas);
   texture_atlases.push_back(&colored_texture_atlas);
 
-  // TODO(andrea): invalidation and capacity logic (LRU?, Better Hashmap?)
   // Init Shaping cache
-  ShapingCache shaping_cache(state.GetVisibleLines());
+  ShapingCache shaping_cache(kShapingCacheBudget, kShapedRunsCacheBudget);
+
+  // Scratch memory of the frames, reused from one to the next
+  FrameArena frame_arena(kFrameArenaSize);
+  hb_buffer_t *buf = hb_buffer_create();
+
+  // Colors code by what its tokens are, lexing only the lines around the
+  // screen
+  Highlighter highlighter(&document, path);
+
+  // Edits the document when in insert mode. The lines it edits are shaped
+  // again from how they were shaped before
+  Editor editor(&document, &state, &wrap_index, &highlighter,
+                [&](const edit_t &edit) {
+                  ReshapeEditedLine(edit.old_text, edit.old_hash,
+                                    document.GetLine(edit.line),
+                                    document.GetLineHash(edit.line),
+                                    edit.start, edit.removed, edit.inserted,
+                                    faces, coverage, &shaping_cache, buf);
+                });
+  glfw_user_pointer.editor = &editor;
+  glfw_user_pointer.ignore_next_char = false;
+
+  // Files which are searched over and over can have their trigrams indexed,
+  // which is done once and then saved next to them
+  TrigramIndex trigram_index(&document, path, kTrigramIndexBudget, nullptr);
+  if (index_trigrams) {
+    trigram_index.Start();
+  }
+
+  // Ctrl+F searches the document in the background, waking up the render
+  // loop when there are new matches to show
+  Search search(&document, &trigram_index, glfwPostEmptyEvent);
+  glfw_user_pointer.search = &search;
+  glfw_user_pointer.finding = false;
+  glfw_user_pointer.jump = 0;
+  glfw_user_pointer.has_current_match = false;
 
+  bool title_is_final = false;
   while (!glfwWindowShouldClose(window.window)) {
     glfwWaitEvents();
 
+    // Catch up with the file, which can only be done once the initial
+    // indexing is over. Lines are shaped by content so the shaping cache
+    // stays valid. If we were looking at the end, keep looking at it
+    if (file_watcher && file_watcher->ConsumeChanges()) {
+      file_changed = true;
+    }
+    if (file_changed && document.IsIndexed() && !document.IsModified()) {
+      bool at_end = state.IsWrapping() ? state.IsAtLastRow(wrap_index)
+                                       : state.IsAtEnd(document.LineCount());
+      // The search and the trigram index read the mapping, which is about
+      // to change. The file might have been replaced, so the search starts
+      // over afterwards. The trigram index carries on with the appended
+      // lines, or starts over if the file was replaced
+      search.Cancel();
+      trigram_index.Pause();
+      uint64_t revision = document.GetRevision();
+      if (document.Refresh()) {
+        file_changed = false;
+        title_is_final = false;
+        // Lines appended to the file don't change the ones before them
+        if (document.GetRevision() != revision) {
+          highlighter.Reset();
+        }
+        if (state.IsWrapping()) {
+          // The file may have been replaced, so measure the lines again
+          wrap_index.Resize(document.LineCount());
+          wrap_index.Invalidate();
+        }
+        if (at_end && state.IsWrapping()) {
+          state.GotoLastRow(wrap_index);
+        } else if (at_end) {
+          state.GotoEnd(document.LineCount());
+        }
+      }
+      trigram_index.Resume();
+      search.Restart(state.GetStartLine());
+    }
+
+    // Edited lines might have matches, or not anymore
+    if (search.IsOutOfDate()) {
+      search.Restart(state.GetStartLine());
+    }
+    // Index the file again once it's saved or replaced, or when indexing it
+    // was interrupted. Lines appended to it are searched without the index
+    if (trigram_index.IsOutOfDate() && !document.IsModified()) {
+      trigram_index.Start();
+    }
+
+    // Show the next or previous match as soon as it's found
+    if (glfw_user_pointer.jump != 0 &&
+        JumpToMatch(&glfw_user_pointer, search, &state, wrap_index)) {
+      glfw_user_pointer.jump = 0;
+    }
+
+    // Lines indexed since the last frame start as a single row
+    if (state.IsWrapping()) {
+      wrap_index.Resize(document.LineCount());
+    }
+
+    // A truncated or replaced file might be shorter than where we were
+    // looking, show its end once it's indexed
+    if (document.IsIndexed() && state.GetStartLine() > 0 &&
+        static_cast<size_t>(state.GetStartLine()) >= document.LineCount()) {
+      if (state.IsWrapping()) {
+        state.GotoLastRow(wrap_index);
+      } else {
+        state.GotoEnd(document.LineCount());
+      }
+    }
+
+    // Show how big the file is, which is an estimate until indexing is done,
+    // or keeps changing while it's being edited or searched
+    if (!title_is_final || document.IsModified() || search.IsActive() ||
+        glfw_user_pointer.finding) {
+      title_is_final = document.IsIndexed() && !document.IsModified() &&
+                       !search.IsActive() && !glfw_user_pointer.finding;
+      UpdateWindowTitle(window.window, path, document, search,
+                        glfw_user_pointer.finding);
+    }
+
     auto t1 = glfwGetTime();
+    uint64_t heap_allocations = frame_arena::HeapAllocations();
 
-    Render(shader, lines, faces, &shaping_cache, texture_atlases, state, VAO,
-           VBO);
+    Render(shader, document, faces, coverage, &shaping_cache, &wrap_index,
+           texture_atlases, state, editor, search, &highlighter, &frame_arena,
+           buf, VAO, VBO);
 
+    heap_allocations = frame_arena::HeapAllocations() - heap_allocations;
     auto t2 = glfwGetTime();
-    printf("Rendering lines took %f ms (%3.0f fps/Hz)\n", (t2 - t1) * 1000,
-           1.f / (t2 - t1));
+    printf("Rendering lines took %f ms (%3.0f fps/Hz), %" PRIu64
+           " heap allocations (%" PRIu64 " arena blocks)\n",
+           (t2 - t1) * 1000, 1.f / (t2 - t1), heap_allocations,
+           frame_arena.GetStats().frame_heap_allocations);
 
     // Swap buffers when drawing is finished
     glfwSwapBuffers(window.window);
   }
 
-  for (auto &face : faces) {
-    FT_Done_Face(get<0>(face));
+  for (auto level : {make_pair("lines", shaping_cache.GetStats()),
+                     make_pair("runs", shaping_cache.GetRunsStats())}) {
+    auto stats = level.second;
+    printf("Shaping cache (%s): %" PRIu64 " hits, %" PRIu64
+           " misses (%" PRIu64 " collisions), %" PRIu64
+           " evictions, %zu entries in %zu KB\n",
+           level.first, stats.hits, stats.misses, stats.collisions,
+           stats.evictions, stats.entries, stats.bytes >> 10);
+  }
+
+  auto arena_stats = frame_arena.GetStats();
+  printf("Frame arena: %" PRIu64 " frames, %" PRIu64
+         " heap allocations, %zu KB peak in %zu KB\n",
+         arena_stats.frames, arena_stats.heap_allocations,
+         arena_stats.peak_bytes >> 10, arena_stats.capacity >> 10);
+
+  if (highlighter.IsEnabled()) {
+    auto highlighter_stats = highlighter.GetStats();
+    printf("Highlighter: %" PRIu64
+           " lines lexed, %zu cached, %zu checkpoints\n",
+           highlighter_stats.lexed_lines, highlighter_stats.cached_lines,
+           highlighter_stats.checkpoints);
+  }
+
+  if (trigram_index.IsReady()) {
+    auto index_stats = trigram_index.GetStats();
+    printf("Trigram index (%s): %zu trigrams in %zu KB, blocks of %zu "
+           "lines\n",
+           index_stats.loaded ? "loaded" : "built", index_stats.trigrams,
+           index_stats.posting_bytes >> 10, index_stats.block_lines);
   }
 
+  hb_buffer_destroy(buf);
+  UnloadFaces(faces);
+
   FT_Done_FreeType(ft);
 
   return 0;
@@ -187,12 +421,23 @@ int main(int argc UNUSED, char **argv) {
 }  // namespace lettera
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    printf("Usage %s FILE\n", argv[0]);
+  bool follow = false, index_trigrams = false;
+  int arg = 1;
+  for (; arg < argc - 1; arg++) {
+    if (strcmp(argv[arg], "-f") == 0) {
+      follow = true;
+    } else if (strcmp(argv[arg], "-t") == 0) {
+      index_trigrams = true;
+    } else {
+      break;
+    }
+  }
+  if (arg != argc - 1) {
+    printf("Usage %s [-f] [-t] FILE\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  lettera::main(argc, argv);
+  lettera::main(argv[argc - 1], follow, index_trigrams);
 
   return 0;
 }
@@ -0,0 +1,314 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./piece_table.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "./hash.h"
+
+namespace piece_table {
+
+// Text typed in is packed in blocks of this size, longer pastes get a block
+// of their own
+static const size_t kAppendBlockSize = 64 << 10;
+
+PieceTable::PieceTable() { Reset(string_view(), nullptr); }
+
+void PieceTable::Reset(string_view original,
+                       const vector<size_t> *line_starts) {
+  nodes_.assign(1, node_t{});
+  free_nodes_.clear();
+  root_ = 0;
+  original_ = original;
+  line_starts_ = line_starts;
+  blocks_.clear();
+  block_starts_.clear();
+  block_size_ = 0;
+  block_used_ = 0;
+  added_size_ = 0;
+  added_newlines_.clear();
+
+  if (!original.empty()) {
+    root_ = NewNode(piece_t{false, 0, original.size(),
+                            CountNewlines(false, 0, original.size())});
+  }
+}
+
+size_t PieceTable::Size() const { return nodes_[root_].bytes; }
+
+size_t PieceTable::LineCount() const { return nodes_[root_].newlines + 1; }
+
+size_t PieceTable::NewNode(const piece_t &piece, uint64_t priority) {
+  node_t node = {piece, priority, 0, 0, piece.length, piece.newlines};
+  if (!free_nodes_.empty()) {
+    size_t index = free_nodes_.back();
+    free_nodes_.pop_back();
+    nodes_[index] = node;
+    return index;
+  }
+  nodes_.push_back(node);
+  return nodes_.size() - 1;
+}
+
+size_t PieceTable::NewNode(const piece_t &piece) {
+  // Scrambling a counter is as good as random for keeping the tree balanced
+  return NewNode(piece, hash::Mix(++next_priority_));
+}
+
+void PieceTable::FreeNodes(size_t node) {
+  if (node == 0) return;
+  FreeNodes(nodes_[node].left);
+  FreeNodes(nodes_[node].right);
+  free_nodes_.push_back(node);
+}
+
+void PieceTable::Update(size_t node) {
+  node_t &n = nodes_[node];
+  n.bytes = nodes_[n.left].bytes + n.piece.length + nodes_[n.right].bytes;
+  n.newlines =
+      nodes_[n.left].newlines + n.piece.newlines + nodes_[n.right].newlines;
+}
+
+void PieceTable::Split(size_t node, size_t bytes, size_t *left,
+                       size_t *right) {
+  if (node == 0) {
+    *left = *right = 0;
+    return;
+  }
+
+  size_t left_bytes = nodes_[nodes_[node].left].bytes;
+  size_t piece_bytes = nodes_[node].piece.length;
+  if (bytes <= left_bytes) {
+    size_t l, r;
+    Split(nodes_[node].left, bytes, &l, &r);
+    nodes_[node].left = r;
+    Update(node);
+    *left = l;
+    *right = node;
+  } else if (bytes >= left_bytes + piece_bytes) {
+    size_t l, r;
+    Split(nodes_[node].right, bytes - left_bytes - piece_bytes, &l, &r);
+    nodes_[node].right = l;
+    Update(node);
+    *left = node;
+    *right = r;
+  } else {
+    // The cut is inside of the piece. The second half takes the right
+    // subtree, and the priority of the node which was above it
+    size_t cut = bytes - left_bytes;
+    piece_t &piece = nodes_[node].piece;
+    size_t newlines = CountNewlines(piece.added, piece.start, cut);
+    piece_t rest = {piece.added, piece.start + cut, piece.length - cut,
+                    piece.newlines - newlines};
+    piece.length = cut;
+    piece.newlines = newlines;
+    size_t second = NewNode(rest, nodes_[node].priority);
+
+    nodes_[second].right = nodes_[node].right;
+    nodes_[node].right = 0;
+    Update(node);
+    Update(second);
+    *left = node;
+    *right = second;
+  }
+}
+
+size_t PieceTable::Merge(size_t left, size_t right) {
+  if (left == 0) return right;
+  if (right == 0) return left;
+
+  if (nodes_[left].priority > nodes_[right].priority) {
+    nodes_[left].right = Merge(nodes_[left].right, right);
+    Update(left);
+    return left;
+  }
+  nodes_[right].left = Merge(left, nodes_[right].left);
+  Update(right);
+  return right;
+}
+
+size_t PieceTable::CountNewlines(bool added, size_t start,
+                                 size_t length) const {
+  if (added) {
+    return std::lower_bound(added_newlines_.begin(), added_newlines_.end(),
+                            start + length) -
+           std::lower_bound(added_newlines_.begin(), added_newlines_.end(),
+                            start);
+  }
+
+  // A line starts after each newline but the one at the very end
+  size_t newlines =
+      std::upper_bound(line_starts_->begin(), line_starts_->end(),
+                       start + length) -
+      std::upper_bound(line_starts_->begin(), line_starts_->end(), start);
+  size_t last = original_.size() - 1;
+  if (!original_.empty() && original_[last] == '\n' && start <= last &&
+      last < start + length) {
+    newlines++;
+  }
+  return newlines;
+}
+
+size_t PieceTable::FindNewline(bool added, size_t start,
+                               size_t newlines) const {
+  if (added) {
+    size_t first = std::lower_bound(added_newlines_.begin(),
+                                    added_newlines_.end(), start) -
+                   added_newlines_.begin();
+    return added_newlines_[first + newlines];
+  }
+
+  size_t first = std::upper_bound(line_starts_->begin(), line_starts_->end(),
+                                  start) -
+                 line_starts_->begin();
+  if (first + newlines < line_starts_->size()) {
+    return (*line_starts_)[first + newlines] - 1;
+  }
+  return original_.size() - 1;
+}
+
+const char *PieceTable::Text(const piece_t &piece) const {
+  if (!piece.added) return original_.data() + piece.start;
+
+  size_t block = std::upper_bound(block_starts_.begin(), block_starts_.end(),
+                                  piece.start) -
+                 block_starts_.begin() - 1;
+  return blocks_[block].get() + (piece.start - block_starts_[block]);
+}
+
+size_t PieceTable::LineStart(size_t line) const {
+  assert(line < LineCount());
+  if (line == 0) return 0;
+
+  // Find the piece with the newline which ends the line before
+  size_t node = root_, offset = 0, newlines = line - 1;
+  while (true) {
+    const node_t &n = nodes_[node];
+    const node_t &left = nodes_[n.left];
+    if (newlines < left.newlines) {
+      node = n.left;
+    } else if (newlines < left.newlines + n.piece.newlines) {
+      newlines -= left.newlines;
+      offset += left.bytes;
+      return offset + 1 +
+             FindNewline(n.piece.added, n.piece.start, newlines) -
+             n.piece.start;
+    } else {
+      newlines -= left.newlines + n.piece.newlines;
+      offset += left.bytes + n.piece.length;
+      node = n.right;
+    }
+  }
+}
+
+void PieceTable::Visit(size_t node, size_t offset, size_t begin, size_t end,
+                       const function<void(string_view)> &f) const {
+  if (node == 0 || offset >= end || offset + nodes_[node].bytes <= begin) {
+    return;
+  }
+
+  const node_t &n = nodes_[node];
+  Visit(n.left, offset, begin, end, f);
+  size_t piece_offset = offset + nodes_[n.left].bytes;
+  size_t first = std::max(begin, piece_offset);
+  size_t last = std::min(end, piece_offset + n.piece.length);
+  if (first < last) {
+    f(string_view(Text(n.piece) + (first - piece_offset), last - first));
+  }
+  Visit(n.right, piece_offset + n.piece.length, begin, end, f);
+}
+
+string_view PieceTable::Read(size_t begin, size_t end, string *text) const {
+  string_view first;
+  size_t pieces = 0;
+  Visit(root_, 0, begin, end, [&](string_view piece) {
+    if (pieces++ == 0) {
+      first = piece;
+      return;
+    }
+    if (pieces == 2) text->assign(first);
+    text->append(piece);
+  });
+  return pieces > 1 ? string_view(*text) : first;
+}
+
+size_t PieceTable::Append(string_view text, bool *contiguous) {
+  *contiguous = block_used_ + text.size() <= block_size_;
+  if (!*contiguous) {
+    block_size_ = std::max(kAppendBlockSize, text.size());
+    blocks_.emplace_back(new char[block_size_]);
+    block_starts_.push_back(added_size_);
+    block_used_ = 0;
+  }
+
+  memcpy(blocks_.back().get() + block_used_, text.data(), text.size());
+  block_used_ += text.size();
+
+  size_t start = added_size_;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '\n') added_newlines_.push_back(start + i);
+  }
+  added_size_ += text.size();
+  return start;
+}
+
+void PieceTable::Insert(size_t offset, string_view text) {
+  assert(offset <= Size());
+  if (text.empty()) return;
+
+  bool contiguous;
+  size_t start = Append(text, &contiguous);
+  piece_t piece = {true, start, text.size(),
+                   CountNewlines(true, start, text.size())};
+
+  size_t before, after;
+  Split(root_, offset, &before, &after);
+
+  // Typing goes on where the last text typed in ended, in the buffer as in
+  // the text, so the piece before grows instead of the tree
+  vector<size_t> path;
+  for (size_t node = before; node != 0; node = nodes_[node].right) {
+    path.push_back(node);
+  }
+  if (!path.empty() && contiguous) {
+    piece_t &last = nodes_[path.back()].piece;
+    if (last.added && last.start + last.length == start) {
+      last.length += piece.length;
+      last.newlines += piece.newlines;
+      for (auto it = path.rbegin(); it != path.rend(); it++) Update(*it);
+      root_ = Merge(before, after);
+      return;
+    }
+  }
+
+  root_ = Merge(Merge(before, NewNode(piece)), after);
+}
+
+void PieceTable::Erase(size_t offset, size_t length) {
+  assert(offset + length <= Size());
+
+  size_t before, middle, after;
+  Split(root_, offset, &before, &middle);
+  Split(middle, length, &middle, &after);
+  FreeNodes(middle);
+  root_ = Merge(before, after);
+}
+
+void PieceTable::ForEachPiece(const function<void(string_view)> &f) const {
+  // In order, without recursing as deep as the tree
+  vector<size_t> stack;
+  size_t node = root_;
+  while (node != 0 || !stack.empty()) {
+    while (node != 0) {
+      stack.push_back(node);
+      node = nodes_[node].left;
+    }
+    node = stack.back();
+    stack.pop_back();
+    f(string_view(Text(nodes_[node].piece), nodes_[node].piece.length));
+    node = nodes_[node].right;
+  }
+}
+
+}  // namespace piece_table
@@ -0,0 +1,124 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_PIECE_TABLE_H_
+#define SRC_PIECE_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace piece_table {
+using std::function;
+using std::string;
+using std::string_view;
+using std::unique_ptr;
+using std::vector;
+
+// A run of bytes of the edited text, from either the original text or the
+// table's append buffer, where the text typed in goes
+typedef struct {
+  bool added;
+  // Offset in its buffer
+  size_t start;
+  size_t length;
+  // How many of the bytes are '\n'
+  size_t newlines;
+} piece_t;
+
+// A text which is being edited, as a sequence of pieces of the original text
+// and of the text typed in. An edit only copies the bytes typed in and cuts
+// at most a couple of pieces, so it costs the same in a 10 byte line as in a
+// 10 MB one, and in a 10 line file as in a 10 million line one: the pieces
+// are the nodes of a treap ordered by position, where each node knows how
+// many bytes and newlines its subtree has, which makes finding an offset or
+// a line and editing O(log n). Where the newlines are inside of a piece is
+// looked up in the sorted offsets of the newlines of its buffer, which for
+// the original text are the line starts the document found.
+// The buffers are never moved or freed, so what Read returns straight from
+// them stays valid as long as the table isn't reset.
+class PieceTable {
+ public:
+  PieceTable();
+
+  // Start over from an unedited text, whose lines start at line_starts,
+  // which must stay as they are as long as the table is used. A newline at
+  // the very end of the text starts no line, see Document
+  void Reset(string_view original, const vector<size_t> *line_starts);
+  size_t Size() const;
+  // Lines are separated by newlines, so a text ending with one ends with an
+  // empty line
+  size_t LineCount() const;
+  // Returns the offset of the first byte of the line
+  size_t LineStart(size_t line) const;
+  // Returns the bytes [begin, end). If they are all in a piece they come
+  // straight from its buffer, otherwise they are copied in text
+  string_view Read(size_t begin, size_t end, string *text) const;
+  // Insert text before the byte at offset
+  void Insert(size_t offset, string_view text);
+  void Erase(size_t offset, size_t length);
+  // Call f with the text of each piece, in order
+  void ForEachPiece(const function<void(string_view)> &f) const;
+
+  // Disable copy
+  PieceTable(const PieceTable &) = delete;
+  // Disable move
+  PieceTable &operator=(const PieceTable &) = delete;
+
+ private:
+  typedef struct {
+    piece_t piece;
+    uint64_t priority;
+    // Indices in nodes_, 0 is no node
+    size_t left;
+    size_t right;
+    // In the subtree
+    size_t bytes;
+    size_t newlines;
+  } node_t;
+
+  // nodes_[0] is a sentinel for missing children
+  vector<node_t> nodes_;
+  vector<size_t> free_nodes_;
+  size_t root_ = 0;
+  uint64_t next_priority_ = 0;
+
+  string_view original_;
+  const vector<size_t> *line_starts_ = nullptr;
+
+  // The append buffer, in blocks which are never reallocated. Offsets in it
+  // count the bytes appended, blocks_starts_ has the one of each block
+  vector<unique_ptr<char[]>> blocks_;
+  vector<size_t> block_starts_;
+  size_t block_size_ = 0;
+  size_t block_used_ = 0;
+  size_t added_size_ = 0;
+  vector<size_t> added_newlines_;
+
+  size_t NewNode(const piece_t &piece, uint64_t priority);
+  size_t NewNode(const piece_t &piece);
+  void FreeNodes(size_t node);
+  void Update(size_t node);
+  // Split the tree into its first `bytes` bytes and the rest, cutting a
+  // piece in two if needed
+  void Split(size_t node, size_t bytes, size_t *left, size_t *right);
+  size_t Merge(size_t left, size_t right);
+  // Returns the offset of the text in the append buffer. Returns true in
+  // contiguous if it directly follows what was appended before in memory
+  size_t Append(string_view text, bool *contiguous);
+  const char *Text(const piece_t &piece) const;
+  size_t CountNewlines(bool added, size_t start, size_t length) const;
+  // Returns the offset in the buffer of the newline after `newlines` others
+  // from start, which must be there
+  size_t FindNewline(bool added, size_t start, size_t newlines) const;
+  // Call f with the parts of the pieces of the subtree, which starts at
+  // offset, which are in [begin, end)
+  void Visit(size_t node, size_t offset, size_t begin, size_t end,
+             const function<void(string_view)> &f) const;
+};
+
+}  // namespace piece_table
+
+#endif  // SRC_PIECE_TABLE_H_
@@ -1,228 +1,615 @@
 // Copyright 2019 <Andrea Cognolato>
 #include "./renderer.h"
+
+#include <cstddef>
+
 #include "./constants.h"
+#include "./hash.h"
 
 namespace renderer {
-void Render(const Shader &shader, const vector<string> &lines,
-            const FaceCollection &faces, ShapingCache *shaping_cache,
+// Lines longer than this are only partially measured when wrapping, and
+// the rest of their rows are estimated
+static const size_t kMaxMeasuredLineLength = 64 << 10;
+// Matches are underlined this many pixels below the baseline
+static const int kUnderlineOffset = 3;
+static const int kUnderlineThickness = 2;
+static const int kCaretWidth = 2;
+// The style flags of glyphs, which the shader reads from their vertices.
+// Rectangles get the second bit from text.vert
+static const GLuint kColoredGlyph = 1;
+
+// Colors are 8 bits per channel in the vertices, which the shader gets
+// normalized back to [0, 1]
+static array<GLubyte, 4> PackColor(const glm::vec4 &color) {
+  array<GLubyte, 4> packed;
+  for (int i = 0; i < 4; i++) {
+    packed[i] = static_cast<GLubyte>(std::clamp(color[i], 0.0f, 1.0f) * 255 +
+                                     0.5f);
+  }
+  return packed;
+}
+
+// Indexed by the kind of token, see highlighter
+static const array<GLubyte, 4> kTokenColors[highlighter::kTokenKinds] = {
+    PackColor(glm::vec4(FOREGROUND_COLOR)),
+    PackColor(glm::vec4(KEYWORD_COLOR)),
+    PackColor(glm::vec4(TYPE_COLOR)),
+    PackColor(glm::vec4(COMMENT_COLOR)),
+    PackColor(glm::vec4(STRING_COLOR)),
+    PackColor(glm::vec4(NUMBER_COLOR)),
+    PackColor(glm::vec4(PREPROCESSOR_COLOR))};
+static const array<GLubyte, 4> kCurrentLineColor =
+    PackColor(glm::vec4(CURRENT_LINE_COLOR));
+
+// A rectangle of the rectangle layer, which is drawn as an instance of a
+// quad: its bottom left and top right corners, and its color
+typedef struct {
+  array<GLfloat, 4> corners;
+  array<GLubyte, 4> color;
+} rectangle_t;
+
+// Lines which fit in a single chunk use the hash the document keeps for them,
+// only the chunks of long lines are hashed as they are drawn
+static uint64_t ChunkHash(string_view chunk, size_t line_length,
+                          uint64_t line_hash) {
+  return chunk.size() == line_length ? line_hash : hash::Hash(chunk);
+}
+
+// Returns how to draw the chunk from the cache. On miss, calculate and cache
+// it. The result is valid until the next chunk is shaped
+static const ShapedText &Shape(string_view chunk, uint64_t chunk_hash,
+                               const FaceCollection &faces,
+                               const FaceCoverage &coverage,
+                               ShapingCache *shaping_cache, hb_buffer_t *buf) {
+  const ShapedText *cached = shaping_cache->Get(chunk_hash, chunk);
+  if (cached != nullptr) {
+    return *cached;
+  }
+
+  ShapedText shaped_text;
+  AssignCodepointsFaces(chunk, faces, coverage, shaping_cache, &shaped_text,
+                        buf);
+  return shaping_cache->Insert(chunk_hash, chunk, std::move(shaped_text));
+}
+
+// Returns how many rows the line takes when wrapped at the given width. A
+// glyph which doesn't fit in what is left of a row goes to the next one,
+// unless it's the first of the row
+static unsigned int CountRows(string_view line, uint64_t line_hash, int width,
+                              const FaceCollection &faces,
+                              const FaceCoverage &coverage,
+                              ShapingCache *shaping_cache, hb_buffer_t *buf) {
+  size_t line_length = line.size();
+  unsigned int rows = 1;
+  int x = 0;
+  size_t measured = 0;
+
+  // A minimized window
+  if (width <= 0) {
+    return rows;
+  }
+
+  while (!line.empty() && measured < kMaxMeasuredLineLength) {
+    auto chunk = line.substr(0, ShapingChunkLength(line));
+    line.remove_prefix(chunk.size());
+    measured += chunk.size();
+
+    uint64_t chunk_hash = ChunkHash(chunk, line_length, line_hash);
+    for (int advance :
+         Shape(chunk, chunk_hash, faces, coverage, shaping_cache, buf)
+             .advances) {
+      if (x > 0 && x + advance > width) {
+        rows++;
+        x = 0;
+      }
+      x += advance;
+    }
+  }
+
+  // Assume the rest of the line is as wide per byte as its beginning
+  if (!line.empty()) {
+    double measured_width = static_cast<double>(rows - 1) * width + x;
+    double rest_width = measured_width / measured * line.size();
+    rows += static_cast<unsigned int>((x + rest_width) / width);
+  }
+  return rows;
+}
+
+void ReshapeEditedLine(string_view old_line, uint64_t old_line_hash,
+                       string_view line, uint64_t line_hash, size_t start,
+                       size_t removed, size_t inserted,
+                       const FaceCollection &faces,
+                       const FaceCoverage &coverage,
+                       ShapingCache *shaping_cache, hb_buffer_t *buf) {
+  // Find the chunk with the edit. The ones before it didn't change, but for
+  // the one which reaches the edit, where it's cut depends on what follows.
+  // When typing in a line it goes on from where the chunks were found at
+  // the last edit, instead of from the start of the line
+  vector<size_t> chunk_starts = shaping_cache->TakeChunkStarts(old_line_hash);
+  while (!chunk_starts.empty() &&
+         chunk_starts.back() + kShapingChunkSize >= start) {
+    chunk_starts.pop_back();
+  }
+  size_t offset = chunk_starts.empty() ? 0 : chunk_starts.back();
+  if (!chunk_starts.empty()) chunk_starts.pop_back();
+
+  // Chunks are hashed with the length of the whole line
+  size_t old_line_length = old_line.size(), line_length = line.size();
+  old_line.remove_prefix(offset);
+  line.remove_prefix(offset);
+  string_view old_chunk, chunk;
+  while (true) {
+    old_chunk = old_line.substr(0, ShapingChunkLength(old_line));
+    chunk = line.substr(0, ShapingChunkLength(line));
+    chunk_starts.push_back(offset);
+    if (offset + old_chunk.size() > start || old_chunk.empty() ||
+        chunk.size() != old_chunk.size()) {
+      break;
+    }
+
+    old_line.remove_prefix(old_chunk.size());
+    line.remove_prefix(chunk.size());
+    offset += chunk.size();
+  }
+  shaping_cache->SetChunkStarts(line_hash, std::move(chunk_starts));
+
+  // The edit has to be all inside of the chunk, which must have grown or
+  // shrunk by as much as the edit did. Otherwise leave it to be shaped from
+  // scratch
+  if (start + removed > offset + old_chunk.size() ||
+      chunk.size() + removed != old_chunk.size() + inserted) {
+    return;
+  }
+
+  // The chunks after it are cut at the same spaces as before, so they are
+  // found in the cache as they are. The chunk's glyphs are taken out of the
+  // cache and edited in place
+  ShapedText shaped_text;
+  if (!shaping_cache->Take(ChunkHash(old_chunk, old_line_length,
+                                     old_line_hash),
+                           old_chunk, &shaped_text)) {
+    return;
+  }
+  ReshapeEdit(chunk, start - offset, removed, inserted, faces, coverage,
+              shaping_cache, &shaped_text, buf);
+  shaping_cache->Insert(ChunkHash(chunk, line_length, line_hash), chunk,
+                        std::move(shaped_text));
+}
+
+void Render(const Shader &shader, const Document &document,
+            const FaceCollection &faces, const FaceCoverage &coverage,
+            ShapingCache *shaping_cache, WrapIndex *wrap_index,
             const vector<TextureAtlas *> &texture_atlases, const State &state,
+            const Editor &editor, const Search &search,
+            Highlighter *highlighter, FrameArena *arena, hb_buffer_t *buf,
             GLuint VAO, GLuint VBO) {
   // Set background color
   glClearColor(BACKGROUND_COLOR);
   glClear(GL_COLOR_BUFFER_BIT);
 
-  // Create the shaping buffer
-  hb_buffer_t *buf = hb_buffer_create();
+  // Whatever the last frame allocated is gone
+  arena->Reset();
+
+  // The glyphs laid out so far, which are drawn all at once when the frame
+  // is done, or before when the atlases run out of room. Each vertex has
+  // the glyph's layer in its atlas and style flags, and its color
+  ArenaVector<array<array<GLfloat, 4>, 6>> quads(arena);
+  ArenaVector<array<GLuint, 2>> texture_ids(arena);
+  ArenaVector<array<GLubyte, 4>> colors(arena);
+  // And the rectangles, like underlines and the caret, which are drawn
+  // together in a single instanced draw
+  ArenaVector<rectangle_t> rectangles(arena);
+
+  // Calculate how many lines to display, each of them takes at least a row
+  // The document might still be growing while it's being indexed
+  unsigned int start_line = state.GetStartLine(),
+               visible_rows = state.GetVisibleLines(),
+               last_line = start_line + visible_rows;
+  if (!document.HasLines(last_line)) {
+    last_line = document.LineCount();
+  }
 
-  // Calculate how many lines to display
-  unsigned int start_line = state.GetStartLine(), last_line;
-  if (state.GetVisibleLines() > lines.size()) {
-    last_line = start_line + lines.size();
-  } else {
-    last_line = start_line + state.GetVisibleLines();
+  auto width = static_cast<int>(state.GetWidth());
+  bool wrapping = state.IsWrapping();
+
+  // Measure the lines on screen and a screen's worth around them, so that
+  // scrolling by rows is exact there
+  int row = 0;
+  if (wrapping) {
+    wrap_index->SetWidth(width);
+    size_t first = start_line > visible_rows ? start_line - visible_rows : 0,
+           last = std::min(static_cast<size_t>(last_line) + visible_rows,
+                           wrap_index->LineCount());
+    for (size_t ix = first; ix < last; ix++) {
+      if (!wrap_index->IsMeasured(ix)) {
+        uint64_t line_hash = document.GetLineHash(ix);
+        wrap_index->SetRows(ix, CountRows(document.GetLine(ix), line_hash,
+                                          width, faces, coverage,
+                                          shaping_cache, buf));
+      }
+    }
+
+    // The rows of the start line above the screen are laid out but not drawn
+    if (start_line < wrap_index->LineCount()) {
+      row = -static_cast<int>(std::min(
+          state.GetStartRow(), wrap_index->GetRows(start_line) - 1));
+    }
   }
 
-  // For each visible line
-  for (unsigned int ix = start_line; ix < last_line; ix++) {
-    auto &line = lines[ix];
-
-    // Get from the cache which codepoints and faces to render the line with.
-    // On miss, calculate and cache them
-    auto it = shaping_cache->find(line);
-    CodePointsFacePair codepoints_face_pair;
-    if (it == shaping_cache->end()) {
-      AssignCodepointsFaces(line, faces, &codepoints_face_pair, buf);
-      (*shaping_cache)[line] = codepoints_face_pair;
-    } else {
-      codepoints_face_pair = it->second;
+  // Without wrapping, lines are cut at the right edge of the window
+  auto screen_is_full = [&](int x) {
+    return wrapping ? row >= static_cast<int>(visible_rows) : x >= width;
+  };
+
+  glBindVertexArray(VAO);
+
+  GLint rectangles_location =
+      glGetUniformLocation(shader.programId, "rectangles");
+
+  // Only the attributes of what is drawn are read, see text.vert
+  auto use_attributes = [](GLuint first, GLuint last) {
+    for (GLuint attribute = 0; attribute < 5; attribute++) {
+      if (attribute >= first && attribute < last) {
+        glEnableVertexAttribArray(attribute);
+      } else {
+        glDisableVertexAttribArray(attribute);
+      }
+    }
+  };
+
+  // Upload the new glyphs, then draw everything laid out so far, the
+  // rectangles under the glyphs. Afterwards any glyph in the atlases can be
+  // replaced
+  auto flush = [&]() {
+    for (auto texture_atlas : texture_atlases) {
+      texture_atlas->Commit();
     }
 
-    auto x = 0;
-    auto y = state.GetHeight() -
-             (state.GetLineHeight() * ((ix - state.GetStartLine()) + 1));
-
-    // Render the line to the screen, given the faces, the codepoints, the
-    // codepoint's textures and a texture atlas
-    {
-      glBindVertexArray(VAO);
-
-      size_t codepoints_in_line = codepoints_face_pair.first.size();
-      size_t i = 0;
-
-      // While I haven't rendered all codepoints
-      while (i < codepoints_in_line) {
-        vector<Character> characters;
-
-        for (; i < codepoints_in_line; ++i) {
-          hb_codepoint_t codepoint = codepoints_face_pair.second[i];
-
-          Character *ch = texture_atlases[0]->Get(codepoint);
-          if (ch != nullptr) {
-            characters.push_back(*ch);
-            continue;
-          }
-
-          ch = texture_atlases[1]->Get(codepoint);
-          if (ch != nullptr) {
-            characters.push_back(*ch);
-            continue;
-          }
-
-          // If I have got space in both
-          if ((texture_atlases[0]->Contains_stale() ||
-               !texture_atlases[0]->IsFull()) &&
-              (texture_atlases[1]->Contains_stale() ||
-               !texture_atlases[1]->IsFull())) {
-            FT_Face face = get<0>(faces[codepoints_face_pair.first[i]]);
-
-            // Get its texture's coordinates and offset from the atlas
-            auto p = RenderGlyph(face, codepoint);
-            if (p.first.colored) {
-              texture_atlases[1]->Insert(codepoint, &p);
-            } else {
-              texture_atlases[0]->Insert(codepoint, &p);
-            }
-            characters.push_back(p.first);
-          } else {
-            break;
-          }
-        }
+    if (!quads.empty() || !rectangles.empty()) {
+      assert(6 * quads.size() == texture_ids.size());
+      assert(texture_ids.size() == colors.size());
+
+      glBindBuffer(GL_ARRAY_BUFFER, VBO);
+      {
+        // Allocate memory, the rectangles go after the glyphs
+        GLsizeiptr glyphs_size =
+            quads.size() * (sizeof(quads[0]) + 6 * sizeof(texture_ids[0]) +
+                            6 * sizeof(colors[0]));
+        GLsizeiptr total_size =
+            glyphs_size + rectangles.size() * sizeof(rectangles[0]);
+        glBufferData(GL_ARRAY_BUFFER, total_size, nullptr, GL_STREAM_DRAW);
+
+        // Load quads
+        GLintptr offset = 0;
+        GLsizeiptr quads_byte_size = quads.size() * (sizeof(quads[0]));
+        glBufferSubData(GL_ARRAY_BUFFER, offset, quads_byte_size,
+                        quads.data());
+
+        // Load texture_ids
+        offset = quads_byte_size;
+        GLsizeiptr texture_ids_byte_size =
+            texture_ids.size() * (sizeof(texture_ids[0]));
+        glBufferSubData(GL_ARRAY_BUFFER, offset, texture_ids_byte_size,
+                        texture_ids.data());
+
+        // Load colors
+        GLintptr colors_offset = offset + texture_ids_byte_size;
+        glBufferSubData(GL_ARRAY_BUFFER, colors_offset,
+                        colors.size() * sizeof(colors[0]), colors.data());
+
+        // Load rectangles
+        GLintptr rectangles_offset = glyphs_size;
+        glBufferSubData(GL_ARRAY_BUFFER, rectangles_offset,
+                        rectangles.size() * sizeof(rectangles[0]),
+                        rectangles.data());
+
+        // Tell shader that layout=0 is a vec4 starting at offset 0
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+                              nullptr);
+
+        // Tell shader that layout=1 is an ivec2 starting after
+        // quads_byte_size
+        glVertexAttribIPointer(1, 2, GL_UNSIGNED_INT, 2 * sizeof(GLuint),
+                               reinterpret_cast<const GLvoid *>(offset));
+
+        // Tell shader that layout=2 is a vec4 of normalized bytes starting
+        // after the texture_ids
+        glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+                              4 * sizeof(GLubyte),
+                              reinterpret_cast<const GLvoid *>(colors_offset));
+
+        // Tell shader that layout=3 is a vec4 and layout=4 a vec4 of
+        // normalized bytes, which advance once per rectangle
+        glVertexAttribPointer(
+            3, 4, GL_FLOAT, GL_FALSE, sizeof(rectangle_t),
+            reinterpret_cast<const GLvoid *>(rectangles_offset +
+                                             offsetof(rectangle_t, corners)));
+        glVertexAttribDivisor(3, 1);
+        glVertexAttribPointer(
+            4, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(rectangle_t),
+            reinterpret_cast<const GLvoid *>(rectangles_offset +
+                                             offsetof(rectangle_t, color)));
+        glVertexAttribDivisor(4, 1);
+      }
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-        // TODO(andrea): instead of allocating on each line, allocate externally
-        // and eventually resize here
-        vector<array<array<GLfloat, 4>, 6>> quads;
-        quads.resize(characters.size());
-        vector<array<GLuint, 2>> texture_ids;
-        texture_ids.resize(characters.size() * 6);
-
-        for (size_t k = 0; k < characters.size(); ++k) {
-          Character &ch = characters[k];
-          // Calculate the character position
-          GLfloat w, h;
-          GLfloat xpos, ypos;
-          // TODO(andrea): we should use harfbuzz's info
-          GLuint advance;
-          if (ch.colored) {
-            auto ratio_x = static_cast<GLfloat>(kFontPixelWidth) /
-                           static_cast<GLfloat>(ch.size.x);
-            auto ratio_y = static_cast<GLfloat>(kFontPixelHeight) /
-                           static_cast<GLfloat>(ch.size.y);
-
-            w = ch.size.x * ratio_x;
-            h = ch.size.y * ratio_y;
-
-            xpos = x + ch.bearing.x * ratio_x;
-            ypos = y - (ch.size.y - ch.bearing.y) * ratio_y;
-            advance = w;
-          } else {
-            w = ch.size.x;
-            h = ch.size.y;
-
-            xpos = x + ch.bearing.x;
-            ypos = y - (ch.size.y - ch.bearing.y);
-
-            advance = (ch.advance >> 6);
-          }
-          x += advance;
+      // Render rectangles, each is the four corners of a triangle strip
+      if (!rectangles.empty()) {
+        use_attributes(3, 5);
+        glUniform1i(rectangles_location, GL_TRUE);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, rectangles.size());
+      }
 
-          auto tc = ch.texture_coordinates;
-
-          // FreeTypes uses a different coordinate convention so we need to
-          // render the quad flipped horizontally, that's why where we should
-          // have 0 we have tc.y and vice versa
-          array<array<GLfloat, 4>, 6> quad = {{// a
-                                               // |
-                                               // |
-                                               // |
-                                               // c--------b
-                                               {xpos, ypos, 0, tc.y},
-                                               {xpos, ypos + h, 0, 0},
-                                               {xpos + w, ypos, tc.x, tc.y},
-                                               // d--------f
-                                               // |
-                                               // |
-                                               // |
-                                               // e
-                                               {xpos, ypos + h, 0, 0},
-                                               {xpos + w, ypos, tc.x, tc.y},
-                                               {xpos + w, ypos + h, tc.x, 0}}};
-          array<GLuint, 2> texture_id = {
-              static_cast<GLuint>(ch.texture_array_index),
-              static_cast<GLuint>(ch.colored)};
-
-          quads[k] = quad;
-          texture_ids[k * 6 + 0] = texture_ids[k * 6 + 1] =
-              texture_ids[k * 6 + 2] = texture_ids[k * 6 + 3] =
-                  texture_ids[k * 6 + 4] = texture_ids[k * 6 + 5] = texture_id;
-        }
+      // Render quads
+      if (!quads.empty()) {
+        use_attributes(0, 3);
+        glUniform1i(rectangles_location, GL_FALSE);
+        glDrawArrays(GL_TRIANGLES, 0, quads.size() * 6);
+      }
+    }
 
-        assert(6 * quads.size() == texture_ids.size());
+    quads.clear();
+    texture_ids.clear();
+    colors.clear();
+    rectangles.clear();
+    for (auto texture_atlas : texture_atlases) {
+      texture_atlas->Invalidate();
+    }
+  };
 
-        // Set the shader's uniforms
-        glm::vec4 fg_color(FOREGROUND_COLOR);
-        glUniform4fv(glGetUniformLocation(shader.programId, "fg_color_sRGB"), 1,
-                     glm::value_ptr(fg_color));
+  // Returns where the glyph is in the atlas, rendering it if it isn't there
+  // yet. Colored faces have an atlas of their own
+  auto get_character = [&](size_t face_index, hb_codepoint_t codepoint) {
+    FT_Face face = get<0>(faces[face_index]);
+    TextureAtlas *texture_atlas = texture_atlases[FT_HAS_COLOR(face) ? 1 : 0];
 
-        // Bind the texture to the active texture unit
-        for (size_t j = 0; j < texture_atlases.size(); j++) {
-          glActiveTexture(GL_TEXTURE0 + j);
-          glBindTexture(GL_TEXTURE_2D_ARRAY, texture_atlases[j]->GetTexture());
-        }
+    Character *ch = texture_atlas->Get(codepoint);
+    if (ch != nullptr) {
+      return *ch;
+    }
 
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        {
-          // Allocate memory
-          GLsizeiptr total_size =
-              quads.size() * (sizeof(quads[0]) + 6 * sizeof(texture_ids[0]));
-          glBufferData(GL_ARRAY_BUFFER, total_size, nullptr, GL_STREAM_DRAW);
-
-          // Load quads
-          GLintptr offset = 0;
-          GLsizeiptr quads_byte_size = quads.size() * (sizeof(quads[0]));
-          glBufferSubData(GL_ARRAY_BUFFER, offset, quads_byte_size,
-                          quads.data());
-
-          // Load texture_ids
-          offset = quads_byte_size;
-          GLsizeiptr texture_ids_byte_size =
-              texture_ids.size() * (sizeof(texture_ids[0]));
-          glBufferSubData(GL_ARRAY_BUFFER, offset, texture_ids_byte_size,
-                          texture_ids.data());
-
-          // Tell shader that layout=0 is a vec4 starting at offset 0
-          glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
-                                nullptr);
-          glEnableVertexAttribArray(0);
-
-          // Tell shader that layout=1 is an ivec2 starting after
-          // quads_byte_size
-          glVertexAttribIPointer(1, 2, GL_UNSIGNED_INT, 2 * sizeof(GLuint),
-                                 reinterpret_cast<const GLvoid *>(offset));
-          glEnableVertexAttribArray(1);
-        }
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // Make room by drawing what uses the atlas, which leaves all of its
+    // glyphs stale
+    if (texture_atlas->IsFull() && !texture_atlas->Contains_stale()) {
+      flush();
+    }
+
+    // Get its texture's coordinates and offset from the atlas
+    auto glyph = RenderGlyph(face, codepoint);
+    texture_atlas->Insert(codepoint, &glyph);
+    return glyph.character;
+  };
+
+  // Lay out a glyph with its pen position at x on the row
+  auto add_glyph = [&](const Character &ch, int x, int glyph_row,
+                       uint8_t kind) {
+    auto y = state.GetHeight() - (state.GetLineHeight() * (glyph_row + 1));
+
+    // Calculate the character position
+    GLfloat w, h;
+    GLfloat xpos, ypos;
+    if (ch.colored) {
+      auto ratio_x = static_cast<GLfloat>(kFontPixelWidth) /
+                     static_cast<GLfloat>(ch.size.x);
+      auto ratio_y = static_cast<GLfloat>(kFontPixelHeight) /
+                     static_cast<GLfloat>(ch.size.y);
+
+      w = ch.size.x * ratio_x;
+      h = ch.size.y * ratio_y;
+
+      xpos = x + ch.bearing.x * ratio_x;
+      ypos = y - (ch.size.y - ch.bearing.y) * ratio_y;
+    } else {
+      w = ch.size.x;
+      h = ch.size.y;
+
+      xpos = x + ch.bearing.x;
+      ypos = y - (ch.size.y - ch.bearing.y);
+    }
+
+    auto tc = ch.texture_coordinates;
+
+    // FreeTypes uses a different coordinate convention so we need to
+    // render the quad flipped horizontally, that's why where we should
+    // have 0 we have tc.y and vice versa
+    array<array<GLfloat, 4>, 6> quad = {{// a
+                                         // |
+                                         // |
+                                         // |
+                                         // c--------b
+                                         {xpos, ypos, 0, tc.y},
+                                         {xpos, ypos + h, 0, 0},
+                                         {xpos + w, ypos, tc.x, tc.y},
+                                         // d--------f
+                                         // |
+                                         // |
+                                         // |
+                                         // e
+                                         {xpos, ypos + h, 0, 0},
+                                         {xpos + w, ypos, tc.x, tc.y},
+                                         {xpos + w, ypos + h, tc.x, 0}}};
+    array<GLuint, 2> texture_id = {
+        static_cast<GLuint>(ch.texture_array_index),
+        ch.colored ? kColoredGlyph : 0};
+
+    quads.push_back(quad);
+    texture_ids.insert_back(6, texture_id);
+    colors.insert_back(6, kTokenColors[kind]);
+  };
+
+  // Returns where the row starts from the bottom of the window
+  auto row_bottom = [&](int bottom_row) {
+    return static_cast<GLfloat>(state.GetHeight()) -
+           static_cast<GLfloat>(state.GetLineHeight()) * (bottom_row + 1);
+  };
+
+  // Lay out a rectangle of the rectangle layer
+  auto add_rectangle = [&](GLfloat x0, GLfloat y0, GLfloat x1, GLfloat y1,
+                           const array<GLubyte, 4> &color) {
+    rectangles.push_back(rectangle_t{{x0, y0, x1, y1}, color});
+  };
+
+  // Underline the glyph with its pen position at x on the row, in its color
+  auto add_underline = [&](int x, int advance, int underline_row,
+                           uint8_t kind) {
+    GLfloat y = row_bottom(underline_row) - kUnderlineOffset;
+    add_rectangle(x, y - kUnderlineThickness, x + advance, y,
+                  kTokenColors[kind]);
+  };
+
+  // The caret is a vertical bar as tall as the row, centered between the
+  // glyphs it is inbetween
+  auto add_caret = [&](int x, int caret_row) {
+    if (caret_row < 0 || caret_row >= static_cast<int>(visible_rows) ||
+        x > width) {
+      return;
+    }
+    GLfloat y = row_bottom(caret_row);
+    add_rectangle(x - kCaretWidth / 2, y, x + kCaretWidth / 2,
+                  y + state.GetLineHeight(), kTokenColors[highlighter::kPlain]);
+  };
+
+  // The line with the caret is highlighted across the window, on the rows
+  // from first_row to last_row which are on screen
+  auto add_current_line = [&](int first_row, int last_row) {
+    first_row = std::max(first_row, 0);
+    last_row = std::min(last_row, static_cast<int>(visible_rows) - 1);
+    if (first_row > last_row) return;
+    add_rectangle(0, row_bottom(last_row), width,
+                  row_bottom(first_row) + state.GetLineHeight(),
+                  kCurrentLineColor);
+  };
+
+  // The matches on screen, in order, which are found by other threads while
+  // the frame is drawn. They are taken once, so that they are all drawn
+  // from the same point of the search
+  ArenaVector<match_t> matches(arena);
+  search.ForEachMatch(start_line, last_line,
+                      [&](const match_t &match) { matches.push_back(match); });
+  size_t next_match = 0;
+
+  // What lines of files which aren't highlighted are made of
+  static const vector<token_t> kNoTokens;
+
+  // For each visible line
+  for (unsigned int ix = start_line;
+       ix < last_line && row < static_cast<int>(visible_rows); ix++, row++) {
+    uint64_t line_hash = document.GetLineHash(ix);
+    auto line = document.GetLine(ix);
+    size_t line_length = line.size();
+
+    // Valid until the highlighter is asked for another line
+    const vector<token_t> &tokens =
+        highlighter->IsEnabled() ? highlighter->GetTokens(ix) : kNoTokens;
+    size_t next_token = 0;
+
+    // The caret goes before the first glyph of the clusters after it
+    bool caret_line = editor.IsInserting() && editor.GetCaretLine() == ix;
+    bool caret_pending = caret_line;
+    size_t caret_column = editor.GetCaretColumn();
+    size_t chunk_offset = 0;
+
+    // The highlight goes under everything on the line, so it's laid out
+    // before it. Rectangles are drawn in order, and each flush draws them
+    // before the glyphs, so nothing laid out later can be covered by it
+    if (caret_line) {
+      int rows = wrapping && ix < wrap_index->LineCount()
+                     ? static_cast<int>(wrap_index->GetRows(ix))
+                     : 1;
+      add_current_line(row, row + rows - 1);
+    }
 
-        // Render quads
-        glDrawArrays(GL_TRIANGLES, 0,
-                     characters.size() * sizeof(characters[0]));
+    auto x = 0;
 
-        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    // Long lines are shaped a chunk at a time and only up to the right edge
+    // of the window, or the bottom of it when wrapping, so a line never
+    // costs more than a screen
+    while (!line.empty() && !screen_is_full(x)) {
+      auto chunk = line.substr(0, ShapingChunkLength(line));
+      line.remove_prefix(chunk.size());
+
+      // Which codepoints and faces to render the chunk with
+      const ShapedText &shaped_text =
+          Shape(chunk, ChunkHash(chunk, line_length, line_hash), faces,
+                coverage, shaping_cache, buf);
+      size_t glyphs_offset = chunk_offset;
+      chunk_offset += chunk.size();
+
+      for (size_t i = 0; i < shaped_text.faces.size(); i++) {
+        int advance = shaped_text.advances[i];
+
+        // Move to the next row when wrapping, otherwise stop at the edge
+        if (wrapping && x > 0 && x + advance > width) {
+          row++;
+          x = 0;
+        }
+        if (screen_is_full(x)) {
+          break;
+        }
+        if (caret_pending &&
+            glyphs_offset + shaped_text.clusters[i] >= caret_column) {
+          add_caret(x, row);
+          caret_pending = false;
+        }
+        // Rows of the start line above the screen
+        if (row < 0) {
+          x += advance;
+          continue;
+        }
 
-        for (size_t j = 0; j < texture_atlases.size(); j++) {
-          texture_atlases[j]->Invalidate();
+        // Glyphs take the color of the token they start in
+        size_t cluster = glyphs_offset + shaped_text.clusters[i];
+        while (next_token < tokens.size() &&
+               tokens[next_token].start + tokens[next_token].length <=
+                   cluster) {
+          next_token++;
         }
+        uint8_t kind = next_token < tokens.size() &&
+                               tokens[next_token].start <= cluster
+                           ? tokens[next_token].kind
+                           : highlighter::kPlain;
+
+        // Glyphs which start inside of a match are underlined
+        while (next_match < matches.size() &&
+               (matches[next_match].line < ix ||
+                (matches[next_match].line == ix &&
+                 matches[next_match].column + matches[next_match].length <=
+                     cluster))) {
+          next_match++;
+        }
+        if (next_match < matches.size() && matches[next_match].line == ix &&
+            matches[next_match].column <= cluster) {
+          add_underline(x, advance, row, kind);
+        }
+
+        Character ch =
+            get_character(shaped_text.faces[i], shaped_text.codepoints[i]);
+        add_glyph(ch, x, row, kind);
+        x += advance;
       }
+    }
 
-      glBindVertexArray(0);
+    // At the end of the line
+    if (caret_pending && line.empty() && !screen_is_full(x)) {
+      add_caret(x, row);
     }
   }
 
-  // Destroy the shaping buffer
-  hb_buffer_destroy(buf);
+  // An empty document still has somewhere to type
+  if (editor.IsInserting() && document.LineCount() == 0) {
+    add_caret(0, 0);
+  }
+
+  // Lex the next screen too, so that scrolling down finds it ready
+  if (highlighter->IsEnabled()) {
+    highlighter->Prefetch(last_line + visible_rows);
+  }
+
+  flush();
+  glBindVertexArray(0);
 }
 
-pair<Character, vector<unsigned char>> RenderGlyph(FT_Face face,
-                                                   hb_codepoint_t codepoint) {
+RenderedGlyph RenderGlyph(FT_Face face, hb_codepoint_t codepoint) {
   FT_Int32 flags = FT_LOAD_DEFAULT | FT_LOAD_TARGET_LCD;
 
   if (FT_HAS_COLOR(face)) {
@@ -241,30 +628,6 @@ pair<Character, vector<unsigned char>> RenderGlyph(FT_Face face,
     }
   }
 
-  vector<unsigned char> bitmap_buffer;
-  if (!FT_HAS_COLOR(face)) {
-    // face->glyph->bitmap.buffer is a rows * pitch matrix but we need a
-    // matrix which is rows * width. For each row i, buffer[i][pitch] is
-    // just a padding byte, therefore we can ignore it
-
-    bitmap_buffer.resize(face->glyph->bitmap.rows * face->glyph->bitmap.width *
-                         3);
-    for (uint i = 0; i < face->glyph->bitmap.rows; i++) {
-      for (uint j = 0; j < face->glyph->bitmap.width; j++) {
-        unsigned char ch =
-            face->glyph->bitmap.buffer[i * face->glyph->bitmap.pitch + j];
-        bitmap_buffer[i * face->glyph->bitmap.width + j] = ch;
-      }
-    }
-  } else {
-    bitmap_buffer.resize(face->glyph->bitmap.rows * face->glyph->bitmap.width *
-                         4);
-    copy(face->glyph->bitmap.buffer,
-         face->glyph->bitmap.buffer +
-             face->glyph->bitmap.rows * face->glyph->bitmap.width * 4,
-         bitmap_buffer.begin());
-  }
-
   GLsizei texture_width;
   GLsizei texture_height;
   if (FT_HAS_COLOR(face)) {
@@ -277,13 +640,19 @@ pair<Character, vector<unsigned char>> RenderGlyph(FT_Face face,
     texture_height = face->glyph->bitmap.rows;
   }
 
-  Character ch;
-  ch.size = glm::ivec2(texture_width, texture_height);
-  ch.bearing = glm::ivec2(face->glyph->bitmap_left, face->glyph->bitmap_top);
-  ch.advance = static_cast<GLuint>(face->glyph->advance.x);
-  ch.colored = static_cast<bool> FT_HAS_COLOR(face);
+  RenderedGlyph glyph;
+  glyph.character.size = glm::ivec2(texture_width, texture_height);
+  glyph.character.bearing =
+      glm::ivec2(face->glyph->bitmap_left, face->glyph->bitmap_top);
+  glyph.character.advance = static_cast<GLuint>(face->glyph->advance.x);
+  glyph.character.colored = static_cast<bool> FT_HAS_COLOR(face);
+
+  // The bitmap is handed over as it is, the atlas copies it straight from
+  // FreeType's buffer
+  glyph.buffer = face->glyph->bitmap.buffer;
+  glyph.pitch = face->glyph->bitmap.pitch;
 
-  return make_pair(ch, bitmap_buffer);
+  return glyph;
 }
 
 }  // namespace renderer
@@ -4,7 +4,9 @@
 
 #include <glad/glad.h>
 
+#include <algorithm>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -12,31 +14,67 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/mat4x4.hpp>
 
+#include "./document.h"
+#include "./editor.h"
 #include "./face_collection.h"
+#include "./frame_arena.h"
+#include "./highlighter.h"
+#include "./search.h"
 #include "./shader.h"
 #include "./shaping_cache.h"
 #include "./state.h"
 #include "./texture_atlas.h"
+#include "./wrap_index.h"
 
 namespace renderer {
+using document::Document;
+using editor::Editor;
 using face_collection::AssignCodepointsFaces;
 using face_collection::FaceCollection;
-using shaping_cache::CodePointsFacePair;
+using face_collection::FaceCoverage;
+using face_collection::ReshapeEdit;
+using face_collection::ShapingChunkLength;
+using frame_arena::ArenaVector;
+using frame_arena::FrameArena;
+using highlighter::Highlighter;
+using highlighter::token_t;
+using search::Search;
+using search::match_t;
+using shaping_cache::ShapedText;
 using shaping_cache::ShapingCache;
 using state::State;
 using std::array;
 using std::get;
-using std::pair;
 using std::string;
+using std::string_view;
 using std::vector;
 using texture_atlas::Character;
+using texture_atlas::RenderedGlyph;
 using texture_atlas::TextureAtlas;
-void Render(const Shader &shader, const vector<string> &lines,
-            const FaceCollection &faces, ShapingCache *shaping_cache,
+using wrap_index::WrapIndex;
+// Draws the visible part of the document, colored by the highlighter, with
+// the matches of the search underlined, and the caret and its line when
+// editing. The temporaries of the frame come from the arena, which is reset
+// first, and text is shaped in buf
+void Render(const Shader &shader, const Document &document,
+            const FaceCollection &faces, const FaceCoverage &coverage,
+            ShapingCache *shaping_cache, WrapIndex *wrap_index,
             const vector<TextureAtlas *> &texture_atlases, const State &state,
+            const Editor &editor, const Search &search,
+            Highlighter *highlighter, FrameArena *arena, hb_buffer_t *buf,
             GLuint VAO, GLuint VBO);
-pair<Character, vector<unsigned char>> RenderGlyph(FT_Face face,
-                                                   hb_codepoint_t codepoint);
+// Shape a line which was just edited, replacing `removed` bytes at `start`
+// with the `inserted` ones, from how it was shaped before the edit, and put
+// it in the cache. Lines which weren't shaped before are left alone
+void ReshapeEditedLine(string_view old_line, uint64_t old_line_hash,
+                       string_view line, uint64_t line_hash, size_t start,
+                       size_t removed, size_t inserted,
+                       const FaceCollection &faces,
+                       const FaceCoverage &coverage,
+                       ShapingCache *shaping_cache, hb_buffer_t *buf);
+// Returns a view of the glyph's bitmap, valid until the next glyph of the
+// face is loaded
+RenderedGlyph RenderGlyph(FT_Face face, hb_codepoint_t codepoint);
 }  // namespace renderer
 
 #endif  // SRC_RENDERER_H_
@@ -0,0 +1,530 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./search.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+
+namespace search {
+using std::lock_guard;
+
+// Lines per chunk, a few MB of text for a typical file, which takes a thread
+// around a millisecond
+static const size_t kChunkLines = 64 << 10;
+// How long to wait for more lines when the next chunk isn't indexed yet
+static const std::chrono::milliseconds kIndexingPollInterval(10);
+// Only the beginning of longer lines is matched against regular expressions,
+// which are matched recursively and would run out of stack on them
+static const size_t kMaxRegexLineLength = 4 << 10;
+
+// Occurrences don't overlap, the next one starts after the end of the last
+static bool OverlapsLast(size_t offset, size_t length,
+                         const vector<size_t> &offsets) {
+  return !offsets.empty() && offset < offsets.back() + length;
+}
+
+static void FindAllScalar(string_view text, string_view query, size_t begin,
+                          vector<size_t> *offsets) {
+  if (!offsets->empty()) {
+    begin = std::max(begin, offsets->back() + query.size());
+  }
+  for (size_t offset = text.find(query, begin); offset != string_view::npos;
+       offset = text.find(query, offset + query.size())) {
+    offsets->push_back(offset);
+  }
+}
+
+// The vectorized loops compare the first and the last byte of the query with
+// 16 or 32 positions at a time, and only compare the rest of it where both
+// match, which is rare for any query but the shortest. They return where they
+// stopped, what's left is up to the scalar loop
+#if defined(__SSE2__)
+static size_t FindAllSSE2(string_view text, string_view query,
+                          vector<size_t> *offsets) {
+  const char *data = text.data();
+  size_t length = query.size();
+  const __m128i first = _mm_set1_epi8(query.front());
+  const __m128i last = _mm_set1_epi8(query.back());
+
+  size_t i = 0;
+  for (; i + length - 1 + 16 <= text.size(); i += 16) {
+    __m128i first_bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    __m128i last_bytes = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(data + i + length - 1));
+    unsigned int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(first_bytes, first),
+                      _mm_cmpeq_epi8(last_bytes, last)));
+    while (mask != 0) {
+      size_t offset = i + __builtin_ctz(mask);
+      if (!OverlapsLast(offset, length, *offsets) &&
+          memcmp(data + offset, query.data(), length) == 0) {
+        offsets->push_back(offset);
+      }
+      mask &= mask - 1;
+    }
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t FindAllAVX2(
+    string_view text, string_view query, vector<size_t> *offsets) {
+  const char *data = text.data();
+  size_t length = query.size();
+  const __m256i first = _mm256_set1_epi8(query.front());
+  const __m256i last = _mm256_set1_epi8(query.back());
+
+  size_t i = 0;
+  for (; i + length - 1 + 32 <= text.size(); i += 32) {
+    __m256i first_bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    __m256i last_bytes = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(data + i + length - 1));
+    unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(first_bytes, first),
+                         _mm256_cmpeq_epi8(last_bytes, last))));
+    while (mask != 0) {
+      size_t offset = i + __builtin_ctz(mask);
+      if (!OverlapsLast(offset, length, *offsets) &&
+          memcmp(data + offset, query.data(), length) == 0) {
+        offsets->push_back(offset);
+      }
+      mask &= mask - 1;
+    }
+  }
+  return i;
+}
+#endif
+
+// Append to offsets where query is found in text
+static void FindAll(string_view text, string_view query,
+                    vector<size_t> *offsets) {
+  size_t scanned = 0;
+#if defined(__SSE2__)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2) {
+    scanned = FindAllAVX2(text, query, offsets);
+  } else {
+    scanned = FindAllSSE2(text, query, offsets);
+  }
+#endif
+  FindAllScalar(text, query, scanned, offsets);
+}
+
+// Returns the longest piece of plain text which every match of the regular
+// expression contains, or nothing when there isn't one or it's not clear.
+// Only what is outside of groups is looked at, and alternatives there mean
+// there isn't one
+static string RequiredLiteral(const string &pattern) {
+  string longest, run;
+  auto end_run = [&]() {
+    if (run.size() > longest.size()) longest = run;
+    run.clear();
+  };
+
+  int depth = 0;
+  for (size_t i = 0; i < pattern.size(); i++) {
+    char c = pattern[i];
+    if (c == '\\') {
+      if (i + 1 == pattern.size()) break;
+      c = pattern[++i];
+      // Classes, anchors, back references and escaped codes aren't plain
+      // text, escaped symbols are
+      if (isalnum(static_cast<unsigned char>(c))) {
+        if (c == 'x') i += 2;
+        if (c == 'u') i += 4;
+        if (c == 'c') i += 1;
+        while (isdigit(static_cast<unsigned char>(c)) &&
+               i + 1 < pattern.size() &&
+               isdigit(static_cast<unsigned char>(pattern[i + 1]))) {
+          i++;
+        }
+        end_run();
+        continue;
+      }
+    } else if (c == '[') {
+      // Skip the set, where a leading ']' is part of it
+      i++;
+      if (i < pattern.size() && pattern[i] == '^') i++;
+      if (i < pattern.size() && pattern[i] == ']') i++;
+      while (i < pattern.size() && pattern[i] != ']') {
+        if (pattern[i] == '\\') i++;
+        i++;
+      }
+      end_run();
+      continue;
+    } else if (c == '{') {
+      while (i < pattern.size() && pattern[i] != '}') i++;
+      end_run();
+      continue;
+    } else if (c == '(' || c == ')') {
+      depth += c == '(' ? 1 : -1;
+      end_run();
+      continue;
+    } else if (c == '|') {
+      if (depth == 0) return string();
+      continue;
+    } else if (strchr(".^$*+?", c) != nullptr) {
+      end_run();
+      continue;
+    }
+
+    if (depth > 0) continue;
+
+    // A quantifier after the character makes it optional, or ends the run
+    char next = i + 1 < pattern.size() ? pattern[i + 1] : '\0';
+    if (next == '?' || next == '*' || next == '{') {
+      end_run();
+    } else {
+      run.push_back(c);
+      if (next == '+') end_run();
+    }
+  }
+  end_run();
+  return longest;
+}
+
+Search::Search(const Document *document, const TrigramIndex *trigram_index,
+               function<void()> on_progress)
+    : document_(document),
+      trigram_index_(trigram_index),
+      on_progress_(on_progress) {}
+
+Search::~Search() { Cancel(); }
+
+void Search::Start(const string &query, bool is_regex, size_t line) {
+  Cancel();
+
+  query_ = query;
+  is_regex_ = is_regex;
+  valid_ = true;
+  literal_ = query;
+  if (is_regex_ && !query_.empty()) {
+    try {
+      regex_.assign(query_, regex::ECMAScript | regex::optimize);
+      literal_ = RequiredLiteral(query_);
+    } catch (const std::regex_error &) {
+      valid_ = false;
+    }
+  }
+  revision_ = document_->GetRevision();
+  // The index is only good for the lines it was built from. The candidates
+  // are looked up by the searching threads, see FindCandidates
+  candidate_blocks_.clear();
+  candidates_found_ = false;
+  use_index_ = valid_ && trigram_index_ != nullptr &&
+               trigram_index_->IsReady() &&
+               trigram_index_->GetRevision() == revision_;
+  chunks_.clear();
+  match_count_ = 0;
+  first_chunk_ = next_chunk_ = line / kChunkLines;
+  next_wrapped_chunk_ = 0;
+  done_ = false;
+
+  if (query_.empty() || !valid_) {
+    done_ = true;
+    return;
+  }
+
+  size_t threads_count = std::max(1u, std::thread::hardware_concurrency());
+  running_threads_ = threads_count;
+  for (size_t i = 0; i < threads_count; i++) {
+    threads_.emplace_back(&Search::Work, this);
+  }
+}
+
+void Search::Restart(size_t line) {
+  string query = query_;
+  Start(query, is_regex_, line);
+}
+
+void Search::Cancel() {
+  stop_ = true;
+  for (auto &t : threads_) t.join();
+  threads_.clear();
+  stop_ = false;
+}
+
+void Search::Clear() { Start(string(), false, 0); }
+
+const string &Search::GetQuery() const { return query_; }
+
+bool Search::IsRegex() const { return is_regex_; }
+
+bool Search::IsValid() const { return valid_; }
+
+bool Search::IsActive() const { return !query_.empty(); }
+
+bool Search::IsDone() const {
+  lock_guard<mutex> lock(mutex_);
+  return done_;
+}
+
+bool Search::IsOutOfDate() const {
+  return IsActive() && revision_ != document_->GetRevision();
+}
+
+size_t Search::MatchCount() const {
+  lock_guard<mutex> lock(mutex_);
+  return match_count_;
+}
+
+void Search::Work() {
+  string buffer;
+  vector<size_t> offsets;
+  vector<match_t> matches;
+
+  FindCandidates();
+  size_t chunk;
+  while (ClaimChunk(&chunk)) {
+    matches.clear();
+    if (!SearchChunk(chunk, &buffer, &offsets, &matches)) break;
+
+    bool found = !matches.empty();
+    {
+      lock_guard<mutex> lock(mutex_);
+      if (chunk >= chunks_.size()) {
+        chunks_.resize(chunk + 1);
+      }
+      chunks_[chunk].searched = true;
+      chunks_[chunk].matches.swap(matches);
+      match_count_ += chunks_[chunk].matches.size();
+    }
+    if (found && on_progress_) on_progress_();
+  }
+
+  bool done;
+  {
+    lock_guard<mutex> lock(mutex_);
+    running_threads_--;
+    done_ = done = running_threads_ == 0 && !stop_;
+  }
+  if (done && on_progress_) on_progress_();
+}
+
+void Search::FindCandidates() {
+  lock_guard<mutex> lock(candidates_mutex_);
+  if (candidates_found_) return;
+
+  candidates_found_ = true;
+  use_index_ = use_index_ &&
+               trigram_index_->FindCandidates(literal_, &candidate_blocks_);
+}
+
+bool Search::ClaimChunk(size_t *chunk) {
+  while (!stop_) {
+    // Once indexed the document doesn't grow anymore, so this must be read
+    // before the lines are counted
+    bool indexed = document_->IsIndexed();
+    size_t lines = document_->LineCount();
+    {
+      lock_guard<mutex> lock(mutex_);
+      if ((next_chunk_ + 1) * kChunkLines <= lines ||
+          (indexed && next_chunk_ * kChunkLines < lines)) {
+        *chunk = next_chunk_++;
+        return true;
+      }
+      // The end isn't there yet, meanwhile search the chunks before the
+      // screen
+      if (next_wrapped_chunk_ < first_chunk_ &&
+          (next_wrapped_chunk_ + 1) * kChunkLines <= lines) {
+        *chunk = next_wrapped_chunk_++;
+        return true;
+      }
+      if (indexed) return false;
+    }
+    std::this_thread::sleep_for(kIndexingPollInterval);
+  }
+  return false;
+}
+
+bool Search::SearchChunk(size_t chunk, string *buffer,
+                         vector<size_t> *offsets,
+                         vector<match_t> *matches) const {
+  size_t first_line = chunk * kChunkLines, end_line = first_line + kChunkLines;
+  if (!use_index_) {
+    return SearchLines(first_line, kChunkLines, buffer, offsets, matches);
+  }
+
+  // The candidate blocks of the lines which were indexed, then the lines
+  // which were appended since the usual way
+  size_t block_lines = trigram_index_->GetBlockLines();
+  size_t indexed_end =
+      std::min(end_line, std::max(first_line, trigram_index_->LineCount()));
+  auto it = std::lower_bound(candidate_blocks_.begin(),
+                             candidate_blocks_.end(), first_line / block_lines);
+  for (; it != candidate_blocks_.end() && *it * block_lines < indexed_end;
+       it++) {
+    size_t begin = std::max(first_line, *it * block_lines);
+    size_t end = std::min((*it + 1) * block_lines, indexed_end);
+    if (!SearchLines(begin, end - begin, buffer, offsets, matches)) {
+      return false;
+    }
+  }
+  if (indexed_end < end_line) {
+    return SearchLines(indexed_end, end_line - indexed_end, buffer, offsets,
+                       matches);
+  }
+  return true;
+}
+
+bool Search::SearchLines(size_t first_line, size_t count, string *buffer,
+                         vector<size_t> *offsets,
+                         vector<match_t> *matches) const {
+  string_view text = document_->GetLines(first_line, count, buffer);
+
+  offsets->clear();
+  if (!literal_.empty()) {
+    FindAll(text, literal_, offsets);
+  }
+  if (is_regex_) {
+    // Without any of the literal there's nothing to match
+    if (!literal_.empty() && offsets->empty()) return true;
+    return MatchLines(text, first_line, *offsets, matches);
+  }
+
+  // Count the lines up to each match
+  size_t line = first_line, line_start = 0, scanned = 0;
+  for (size_t offset : *offsets) {
+    while (const char *newline = static_cast<const char *>(
+               memchr(text.data() + scanned, '\n', offset - scanned))) {
+      line++;
+      scanned = line_start = newline - text.data() + 1;
+    }
+    scanned = offset;
+    matches->push_back(match_t{line, offset - line_start, query_.size()});
+  }
+  return true;
+}
+
+bool Search::MatchLines(string_view text, size_t first_line,
+                        const vector<size_t> &offsets,
+                        vector<match_t> *matches) const {
+  size_t next_offset = 0;
+  size_t line = first_line;
+  for (size_t start = 0; start < text.size(); line++) {
+    // Regular expressions can take a while, stop as soon as asked to
+    if (stop_) return false;
+
+    auto newline = static_cast<const char *>(
+        memchr(text.data() + start, '\n', text.size() - start));
+    size_t end = newline != nullptr ? newline - text.data() : text.size();
+    string_view line_text = text.substr(start, end - start);
+
+    // Skip the lines without the literal
+    if (!literal_.empty()) {
+      while (next_offset < offsets.size() && offsets[next_offset] < start) {
+        next_offset++;
+      }
+      if (next_offset == offsets.size()) break;
+      if (offsets[next_offset] >= end) {
+        start = end + 1;
+        continue;
+      }
+    }
+    start = end + 1;
+
+    if (!line_text.empty() && line_text.back() == '\r') {
+      line_text.remove_suffix(1);
+    }
+    line_text = line_text.substr(0, kMaxRegexLineLength);
+
+    for (std::cregex_iterator it(line_text.data(),
+                                 line_text.data() + line_text.size(), regex_),
+         last;
+         it != last; ++it) {
+      if (it->length() > 0) {
+        matches->push_back(match_t{line, static_cast<size_t>(it->position()),
+                                   static_cast<size_t>(it->length())});
+      }
+    }
+  }
+  return true;
+}
+
+// Matches are sorted by position
+static bool Before(const match_t &match, size_t line, size_t column) {
+  return match.line < line || (match.line == line && match.column < column);
+}
+
+void Search::ForEachMatch(size_t first, size_t last,
+                          const function<void(const match_t &)> &f) const {
+  lock_guard<mutex> lock(mutex_);
+  for (size_t chunk = first / kChunkLines;
+       chunk < chunks_.size() && chunk * kChunkLines < last; chunk++) {
+    auto &matches = chunks_[chunk].matches;
+    auto it = std::lower_bound(
+        matches.begin(), matches.end(), first,
+        [](const match_t &match, size_t line) { return match.line < line; });
+    for (; it != matches.end() && it->line < last; it++) {
+      f(*it);
+    }
+  }
+}
+
+bool Search::FindNext(size_t line, size_t column, match_t *match) const {
+  lock_guard<mutex> lock(mutex_);
+
+  // Down to the end of the document...
+  size_t first_chunk = line / kChunkLines;
+  for (size_t chunk = first_chunk; chunk < chunks_.size(); chunk++) {
+    if (!chunks_[chunk].searched) return false;
+
+    auto &matches = chunks_[chunk].matches;
+    auto it = std::lower_bound(
+        matches.begin(), matches.end(), 0,
+        [&](const match_t &m, int) { return Before(m, line, column); });
+    if (it != matches.end()) {
+      *match = *it;
+      return true;
+    }
+  }
+  // ...which might not have been searched yet...
+  if (!done_) return false;
+
+  // ...then from its beginning
+  for (size_t chunk = 0; chunk <= first_chunk && chunk < chunks_.size();
+       chunk++) {
+    if (!chunks_[chunk].matches.empty()) {
+      *match = chunks_[chunk].matches.front();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Search::FindPrevious(size_t line, size_t column, match_t *match) const {
+  lock_guard<mutex> lock(mutex_);
+
+  // Up to the beginning of the document...
+  size_t first_chunk = line / kChunkLines;
+  for (size_t chunk = first_chunk + 1; chunk-- > 0;) {
+    if (chunk >= chunks_.size() || !chunks_[chunk].searched) return false;
+
+    auto &matches = chunks_[chunk].matches;
+    auto it = std::lower_bound(
+        matches.begin(), matches.end(), 0,
+        [&](const match_t &m, int) { return Before(m, line, column); });
+    if (it != matches.begin()) {
+      *match = *(it - 1);
+      return true;
+    }
+  }
+  // ...then from its end, which might not have been searched yet
+  if (!done_) return false;
+
+  for (size_t chunk = chunks_.size(); chunk-- > first_chunk;) {
+    if (!chunks_[chunk].matches.empty()) {
+      *match = chunks_[chunk].matches.back();
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace search
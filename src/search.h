@@ -0,0 +1,161 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_SEARCH_H_
+#define SRC_SEARCH_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "./document.h"
+#include "./trigram_index.h"
+
+namespace search {
+using document::Document;
+using std::atomic;
+using std::function;
+using std::mutex;
+using std::regex;
+using std::string;
+using std::string_view;
+using std::thread;
+using std::vector;
+using trigram_index::TrigramIndex;
+
+typedef struct {
+  size_t line;
+  // Bytes from the start of the line
+  size_t column;
+  size_t length;
+} match_t;
+
+// Looks for a string, or a regular expression, in the document on all of the
+// cores, while it's being looked at. The lines are split in chunks which are
+// searched starting from the one on screen, and the matches of each chunk can
+// be seen as soon as it is done, so the first ones are usually there by the
+// next frame. Chunks which haven't been indexed yet are searched once they
+// are.
+// Regular expressions are matched a line at a time. They are slow, so only
+// the lines with the longest piece of plain text every match must have are
+// tried, which most of the time rules out most of the document.
+// With a trigram index which is ready, only the blocks of lines which have
+// all of the trigrams of the query, or of its literal, are searched.
+// The search reads the text of the document, so it must be cancelled before
+// the document is refreshed or saved. Edits make the matches out of date,
+// see IsOutOfDate.
+class Search {
+ public:
+  // on_progress is called from the searching threads when there are new
+  // matches, and when the search is done. The index is optional
+  Search(const Document *document, const TrigramIndex *trigram_index,
+         function<void()> on_progress);
+  ~Search();
+
+  // Look for query instead of what was looked for before, starting from the
+  // chunk with the line. An empty query matches nothing, and so does an
+  // invalid regular expression
+  void Start(const string &query, bool is_regex, size_t line);
+  // Look for the same query again, from scratch
+  void Restart(size_t line);
+  // Stop looking, the matches found so far are kept
+  void Cancel();
+  // Cancel and forget the query
+  void Clear();
+
+  const string &GetQuery() const;
+  bool IsRegex() const;
+  // Returns false if the query is a regular expression which doesn't compile
+  bool IsValid() const;
+  // Returns true if there is a query
+  bool IsActive() const;
+  // Returns true when the whole document has been searched
+  bool IsDone() const;
+  // Returns true if the document was edited since the search was started
+  bool IsOutOfDate() const;
+  // Returns the number of matches found so far
+  size_t MatchCount() const;
+
+  // Call f with the matches found so far in [first, last) lines, in order
+  void ForEachMatch(size_t first, size_t last,
+                    const function<void(const match_t &)> &f) const;
+  // Find the first match at or after the column of the line, going around
+  // the end of the document. Returns false if there is none, or if it isn't
+  // known yet because the lines in between are still being searched
+  bool FindNext(size_t line, size_t column, match_t *match) const;
+  // Find the last match before the column of the line, going around the
+  // beginning of the document, like FindNext
+  bool FindPrevious(size_t line, size_t column, match_t *match) const;
+
+  // Disable copy
+  Search(const Search &) = delete;
+  // Disable move
+  Search &operator=(const Search &) = delete;
+
+ private:
+  typedef struct {
+    bool searched;
+    vector<match_t> matches;
+  } chunk_t;
+
+  const Document *document_;
+  const TrigramIndex *trigram_index_;
+  function<void()> on_progress_;
+  string query_;
+  bool is_regex_ = false;
+  regex regex_;
+  bool valid_ = true;
+  // What to look for in the text before matching lines against the regular
+  // expression, the query itself when it isn't one
+  string literal_;
+  uint64_t revision_ = 0;
+  // The blocks of the trigram index to search, when it's used. Set by the
+  // first searching thread, the others wait for it
+  mutex candidates_mutex_;
+  bool candidates_found_ = false;
+  bool use_index_ = false;
+  vector<uint32_t> candidate_blocks_;
+
+  // Guards everything below, which the searching threads share
+  mutable mutex mutex_;
+  // Indexed by chunk, grows as chunks are searched
+  vector<chunk_t> chunks_;
+  size_t match_count_ = 0;
+  // Chunks are handed out from the one on screen to the end of the document,
+  // then from the beginning of the document up to it
+  size_t first_chunk_ = 0;
+  size_t next_chunk_ = 0;
+  size_t next_wrapped_chunk_ = 0;
+  size_t running_threads_ = 0;
+  bool done_ = false;
+
+  atomic<bool> stop_{false};
+  vector<thread> threads_;
+
+  void Work();
+  // Look the query up in the index, which takes a while when its trigrams
+  // are common, so it's done off the thread which started the search
+  void FindCandidates();
+  // Returns false when there are no chunks left, waiting for the lines of the
+  // next one to be indexed if needed
+  bool ClaimChunk(size_t *chunk);
+  // Returns false if the search was cancelled before the chunk was done
+  bool SearchChunk(size_t chunk, string *buffer, vector<size_t> *offsets,
+                   vector<match_t> *matches) const;
+  bool SearchLines(size_t first_line, size_t count, string *buffer,
+                   vector<size_t> *offsets, vector<match_t> *matches) const;
+  // Match the lines of text against the regular expression. With a literal,
+  // only the lines where it was found at one of the offsets are tried
+  bool MatchLines(string_view text, size_t first_line,
+                  const vector<size_t> &offsets,
+                  vector<match_t> *matches) const;
+};
+
+}  // namespace search
+
+#endif  // SRC_SEARCH_H_
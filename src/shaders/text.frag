@@ -1,11 +1,14 @@
 #version 330
 
 in vec2 ex_texCoords;
+// The layer of the glyph in its atlas, and its style flags: 1 for colored
+// glyphs, 2 for rectangles which cover all of their pixels
 flat in ivec2 ex_texture_ids;
+// The color of the glyph, in sRGB
+flat in vec4 ex_color;
 
 uniform sampler2DArray monochromatic_texture_array;
 uniform sampler2DArray colored_texture_array;
-uniform vec4 fg_color_sRGB;
 
 // Dual source blending
 // https://www.khronos.org/opengl/wiki/Blending#Dual_Source_Blending
@@ -18,14 +21,18 @@ void main()
 {
     vec4 alpha_map;
 
-    // If it's colored
-    if(ex_texture_ids.y==1) {
+    // If it's a rectangle, all of it is covered
+    if((ex_texture_ids.y & 2) == 2) {
+        alpha_map = vec4(1.0);
+        color = ex_color;
+    } else if((ex_texture_ids.y & 1) == 1) {
+        // If it's colored
         alpha_map = texture(colored_texture_array, vec3(ex_texCoords, ex_texture_ids.x));
         color = alpha_map;
     } else {
         alpha_map = texture(monochromatic_texture_array, vec3(ex_texCoords, ex_texture_ids.x));
-        color = fg_color_sRGB;
+        color = ex_color;
     }
 
-    colorMask = fg_color_sRGB.a*alpha_map;
+    colorMask = ex_color.a*alpha_map;
 }
@@ -2,14 +2,35 @@
 
 layout (location=0) in vec4 in_vertex;
 layout (location=1) in ivec2 in_texture_ids;
+layout (location=2) in vec4 in_color;
+// Once per instance of the rectangles: their bottom left and top right
+// corners, and their color
+layout (location=3) in vec4 in_rectangle;
+layout (location=4) in vec4 in_rectangle_color;
 
 uniform mat4 projection;
+// Whether the rectangles are drawn instead of the glyphs
+uniform bool rectangles;
 
 out vec2 ex_texCoords;
 flat out ivec2 ex_texture_ids;
+flat out vec4 ex_color;
 
 void main() {
+    if (rectangles) {
+        // The vertices 0 to 3 of the triangle strip are the corners
+        vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+        vec2 position = mix(in_rectangle.xy, in_rectangle.zw, corner);
+        gl_Position = projection * vec4(position, 0.0, 1.0);
+        ex_texCoords = vec2(0.0);
+        // Solid, see text.frag
+        ex_texture_ids = ivec2(0, 2);
+        ex_color = in_rectangle_color;
+        return;
+    }
+
     gl_Position = projection * vec4(in_vertex.xy, 0.0, 1.0);
     ex_texCoords = in_vertex.zw;
     ex_texture_ids = in_texture_ids;
+    ex_color = in_color;
 }
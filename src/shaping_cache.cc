@@ -0,0 +1,142 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./shaping_cache.h"
+
+#include <utility>
+
+#include "./hash.h"
+
+namespace shaping_cache {
+
+// Per entry bookkeeping of the list and of the index: their nodes, pointers
+// and a bucket
+static const size_t kEntryOverhead = 8 * sizeof(void *);
+
+static size_t EntryBytes(const string &text, const ShapedText &shaped_text) {
+  return kEntryOverhead + text.capacity() +
+         shaped_text.faces.capacity() * sizeof(shaped_text.faces[0]) +
+         shaped_text.codepoints.capacity() *
+             sizeof(shaped_text.codepoints[0]) +
+         shaped_text.advances.capacity() * sizeof(shaped_text.advances[0]) +
+         shaped_text.clusters.capacity() * sizeof(shaped_text.clusters[0]) +
+         shaped_text.unsafe_to_break.capacity();
+}
+
+// Runs of different faces with the same text are different entries
+static uint64_t RunHash(size_t face, uint64_t hash) {
+  return hash::Mix(hash + face);
+}
+
+ShapingCache::ShapingCache(size_t budget, size_t runs_budget) {
+  lines_.budget = budget;
+  lines_.stats = {0, 0, 0, 0, 0, 0};
+  runs_.budget = runs_budget;
+  runs_.stats = {0, 0, 0, 0, 0, 0};
+}
+
+const ShapedText *ShapingCache::Get(uint64_t hash, string_view text) {
+  return Get(&lines_, 0, hash, text);
+}
+
+const ShapedText &ShapingCache::Insert(uint64_t hash, string_view text,
+                                       ShapedText shaped_text) {
+  return Insert(&lines_, 0, hash, text, std::move(shaped_text));
+}
+
+bool ShapingCache::Take(uint64_t hash, string_view text,
+                        ShapedText *shaped_text) {
+  if (Get(&lines_, 0, hash, text) == nullptr) return false;
+
+  // Get moved the entry to the front
+  entry_t &entry = lines_.entries.front();
+  *shaped_text = std::move(entry.shaped_text);
+  lines_.stats.bytes -= entry.bytes;
+  lines_.index.erase(hash);
+  lines_.entries.pop_front();
+  return true;
+}
+
+vector<size_t> ShapingCache::TakeChunkStarts(uint64_t line_hash) {
+  if (line_hash != chunked_line_hash_) return {};
+  chunked_line_hash_ = 0;
+  return std::move(chunk_starts_);
+}
+
+void ShapingCache::SetChunkStarts(uint64_t line_hash,
+                                  vector<size_t> chunk_starts) {
+  chunked_line_hash_ = line_hash;
+  chunk_starts_ = std::move(chunk_starts);
+}
+
+const ShapedText *ShapingCache::GetRun(size_t face, uint64_t hash,
+                                       string_view text) {
+  return Get(&runs_, face, RunHash(face, hash), text);
+}
+
+const ShapedText &ShapingCache::InsertRun(size_t face, uint64_t hash,
+                                          string_view text,
+                                          ShapedText shaped_text) {
+  return Insert(&runs_, face, RunHash(face, hash), text,
+                std::move(shaped_text));
+}
+
+cache_stats_t ShapingCache::GetStats() const { return GetStats(lines_); }
+
+cache_stats_t ShapingCache::GetRunsStats() const { return GetStats(runs_); }
+
+const ShapedText *ShapingCache::Get(level_t *level, size_t face,
+                                    uint64_t hash, string_view text) {
+  auto it = level->index.find(hash);
+  if (it == level->index.end()) {
+    level->stats.misses++;
+    return nullptr;
+  }
+  if (it->second->face != face || it->second->text != text) {
+    level->stats.collisions++;
+    level->stats.misses++;
+    return nullptr;
+  }
+
+  level->stats.hits++;
+  level->entries.splice(level->entries.begin(), level->entries, it->second);
+  return &it->second->shaped_text;
+}
+
+const ShapedText &ShapingCache::Insert(level_t *level, size_t face,
+                                       uint64_t hash, string_view text,
+                                       ShapedText shaped_text) {
+  auto it = level->index.find(hash);
+  if (it != level->index.end()) {
+    level->stats.bytes -= it->second->bytes;
+    level->entries.erase(it->second);
+    level->index.erase(it);
+  }
+
+  level->entries.push_front(
+      {hash, face, string(text), std::move(shaped_text), 0});
+  entry_t &entry = level->entries.front();
+  entry.bytes = EntryBytes(entry.text, entry.shaped_text);
+  level->index.emplace(hash, level->entries.begin());
+  level->stats.bytes += entry.bytes;
+
+  Evict(level);
+  return entry.shaped_text;
+}
+
+void ShapingCache::Evict(level_t *level) {
+  // The newest entry is always kept, even if it's over budget by itself
+  while (level->stats.bytes > level->budget && level->entries.size() > 1) {
+    entry_t &entry = level->entries.back();
+    level->index.erase(entry.hash);
+    level->stats.bytes -= entry.bytes;
+    level->stats.evictions++;
+    level->entries.pop_back();
+  }
+}
+
+cache_stats_t ShapingCache::GetStats(const level_t &level) {
+  cache_stats_t stats = level.stats;
+  stats.entries = level.entries.size();
+  return stats;
+}
+
+}  // namespace shaping_cache
@@ -4,19 +4,118 @@
 
 #include <harfbuzz/hb.h>
 
+#include <cstdint>
+#include <list>
 #include <string>
+#include <string_view>
 #include <unordered_map>
-#include <utility>
 #include <vector>
 
 namespace shaping_cache {
-using std::pair;
+using std::list;
 using std::string;
+using std::string_view;
 using std::unordered_map;
 using std::vector;
 
-typedef pair<vector<size_t>, vector<hb_codepoint_t>> CodePointsFacePair;
-typedef unordered_map<string, CodePointsFacePair> ShapingCache;
+// How to draw a piece of text: for each glyph the face it comes from, its
+// index in that face and how far it moves the pen, in pixels. Then where
+// its cluster starts in the text, in bytes, and whether the text can't be
+// split there without shaping both sides again, which is what
+// HB_GLYPH_FLAG_UNSAFE_TO_BREAK says
+typedef struct {
+  vector<size_t> faces;
+  vector<hb_codepoint_t> codepoints;
+  vector<int> advances;
+  vector<uint32_t> clusters;
+  vector<uint8_t> unsafe_to_break;
+} ShapedText;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  // Different text with the same hash, counted as misses too
+  uint64_t collisions;
+  uint64_t evictions;
+  // Estimated memory used by the entries, keys included
+  size_t bytes;
+  size_t entries;
+} cache_stats_t;
+
+// Shaped text by content, so that scrolling back to a line, or meeting the
+// same line elsewhere in the file, doesn't shape it again. The least recently
+// used entries are evicted to stay within a memory budget.
+// Entries are found by a 64-bit hash of the text computed by the caller, see
+// hash::Hash, which lines get from the document without hashing them every
+// frame. The text is still compared on a hit, to rule out collisions.
+// A second level keeps the runs of a single face which lines are made of,
+// split at spaces, since lines which are all different (like in logs) still
+// share most of their words.
+class ShapingCache {
+ public:
+  ShapingCache(size_t budget, size_t runs_budget);
+
+  // Returns nullptr on miss. The entry stays valid until the next Insert
+  const ShapedText *Get(uint64_t hash, string_view text);
+  // Returns the inserted entry, which is valid until the next Insert. Replaces
+  // any entry with the same hash
+  const ShapedText &Insert(uint64_t hash, string_view text,
+                           ShapedText shaped_text);
+
+  // Like Get, but moves the entry out of the cache into shaped_text, for
+  // when it's about to be replaced by an edited copy. Returns false on miss
+  bool Take(uint64_t hash, string_view text, ShapedText *shaped_text);
+
+  // Where the chunks of the line which was edited last start, up to the
+  // chunk with the edit, so that typing in a long line doesn't chunk it
+  // from its start every time. Returns them if the line still has the same
+  // hash, or else nothing
+  vector<size_t> TakeChunkStarts(uint64_t line_hash);
+  void SetChunkStarts(uint64_t line_hash, vector<size_t> chunk_starts);
+
+  // Like Get and Insert, for text shaped with a single face
+  const ShapedText *GetRun(size_t face, uint64_t hash, string_view text);
+  const ShapedText &InsertRun(size_t face, uint64_t hash, string_view text,
+                              ShapedText shaped_text);
+
+  cache_stats_t GetStats() const;
+  cache_stats_t GetRunsStats() const;
+
+  // Disable copy
+  ShapingCache(const ShapingCache &) = delete;
+  // Disable move
+  ShapingCache &operator=(const ShapingCache &) = delete;
+
+ private:
+  typedef struct {
+    uint64_t hash;
+    size_t face;
+    string text;
+    ShapedText shaped_text;
+    size_t bytes;
+  } entry_t;
+
+  typedef struct {
+    size_t budget;
+    // Most recently used first
+    list<entry_t> entries;
+    unordered_map<uint64_t, list<entry_t>::iterator> index;
+    cache_stats_t stats;
+  } level_t;
+
+  level_t lines_;
+  level_t runs_;
+
+  uint64_t chunked_line_hash_ = 0;
+  vector<size_t> chunk_starts_;
+
+  static const ShapedText *Get(level_t *level, size_t face, uint64_t hash,
+                               string_view text);
+  static const ShapedText &Insert(level_t *level, size_t face, uint64_t hash,
+                                  string_view text, ShapedText shaped_text);
+  static void Evict(level_t *level);
+  static cache_stats_t GetStats(const level_t &level);
+};
 
 }  // namespace shaping_cache
 
@@ -1,6 +1,8 @@
 // Copyright 2019 <Andrea Cognolato>
 #include "./state.h"
 
+#include <algorithm>
+
 namespace state {
 State::State(unsigned int width, unsigned int height, unsigned int line_height,
              int start_line)
@@ -18,13 +20,89 @@ void State::RecalculateVisibleLines() {
 }
 int State::GetStartLine() const { return start_line_; }
 unsigned int State::GetVisibleLines() const { return visible_lines_; }
+unsigned int State::GetWidth() const { return width_; }
 unsigned int State::GetHeight() const { return height_; }
 unsigned int State::GetLineHeight() const { return line_height_; }
 void State::GoDown(unsigned int amount) { start_line_ -= amount; }
 void State::GoUp(unsigned int amount) { start_line_ += amount; }
-void State::GotoBeginning() { start_line_ = 0; }
+void State::GotoBeginning() {
+  start_line_ = 0;
+  start_row_ = 0;
+}
 void State::GotoEnd(unsigned int lines_count) {
-  start_line_ = lines_count - visible_lines_;
+  start_row_ = 0;
+  // Documents shorter than the screen are shown from the top
+  if (lines_count < visible_lines_) {
+    start_line_ = 0;
+  } else {
+    start_line_ = lines_count - visible_lines_;
+  }
+}
+bool State::IsAtEnd(unsigned int lines_count) const {
+  return start_line_ + visible_lines_ >= lines_count;
+}
+
+bool State::IsWrapping() const { return wrapping_; }
+void State::ToggleWrapping() {
+  wrapping_ = !wrapping_;
+  start_row_ = 0;
+}
+unsigned int State::GetStartRow() const { return start_row_; }
+
+uint64_t State::GetFirstRow(const WrapIndex &wrap_index) const {
+  // The document got shorter
+  if (static_cast<size_t>(start_line_) >= wrap_index.LineCount()) {
+    return wrap_index.RowCount();
+  }
+  // The start line may have been measured again and have less rows now
+  unsigned int start_row =
+      std::min(start_row_, wrap_index.GetRows(start_line_) - 1);
+  return wrap_index.RowOf(start_line_) + start_row;
+}
+void State::GotoRow(uint64_t row, const WrapIndex &wrap_index) {
+  auto position = wrap_index.LineAt(row);
+  start_line_ = position.first;
+  start_row_ = position.second;
+}
+void State::ScrollRows(int64_t amount, const WrapIndex &wrap_index) {
+  if (wrap_index.LineCount() == 0) return;
+
+  int64_t row = GetFirstRow(wrap_index) + amount;
+  int64_t last_row = wrap_index.RowCount() - visible_lines_;
+  row = std::max<int64_t>(std::min(row, last_row), 0);
+  GotoRow(row, wrap_index);
+}
+void State::GotoLastRow(const WrapIndex &wrap_index) {
+  if (wrap_index.RowCount() < visible_lines_) {
+    GotoBeginning();
+  } else {
+    GotoRow(wrap_index.RowCount() - visible_lines_, wrap_index);
+  }
+}
+bool State::IsAtLastRow(const WrapIndex &wrap_index) const {
+  if (wrap_index.LineCount() == 0) return true;
+  return GetFirstRow(wrap_index) + visible_lines_ >= wrap_index.RowCount();
+}
+
+void State::ShowLine(size_t line, const WrapIndex &wrap_index) {
+  if (!wrapping_) {
+    if (line < static_cast<size_t>(start_line_)) {
+      start_line_ = line;
+    } else if (line >= start_line_ + visible_lines_) {
+      start_line_ = line - visible_lines_ + 1;
+    }
+    return;
+  }
+
+  if (line >= wrap_index.LineCount()) return;
+  uint64_t first_row = GetFirstRow(wrap_index);
+  uint64_t line_row = wrap_index.RowOf(line);
+  uint64_t rows = std::min<uint64_t>(wrap_index.GetRows(line), visible_lines_);
+  if (line_row < first_row) {
+    GotoRow(line_row, wrap_index);
+  } else if (line_row + rows > first_row + visible_lines_) {
+    GotoRow(line_row + rows - visible_lines_, wrap_index);
+  }
 }
 
 }  // namespace state
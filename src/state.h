@@ -2,7 +2,13 @@
 #ifndef SRC_STATE_H_
 #define SRC_STATE_H_
 
+#include <cstdint>
+
+#include "./wrap_index.h"
+
 namespace state {
+using wrap_index::WrapIndex;
+
 class State {
  public:
   State(unsigned int width, unsigned int height, unsigned int line_height,
@@ -15,12 +21,27 @@ class State {
   }
   int GetStartLine() const;
   unsigned int GetVisibleLines() const;
+  unsigned int GetWidth() const;
   unsigned int GetHeight() const;
   unsigned int GetLineHeight() const;
   void GoDown(unsigned int amount);
   void GoUp(unsigned int amount);
   void GotoBeginning();
   void GotoEnd(unsigned int lines_count);
+  bool IsAtEnd(unsigned int lines_count) const;
+
+  // With soft wrapping the screen starts at one of the rows of the start line
+  // and scrolling moves by rows
+  bool IsWrapping() const;
+  void ToggleWrapping();
+  unsigned int GetStartRow() const;
+  void ScrollRows(int64_t amount, const WrapIndex &wrap_index);
+  void GotoLastRow(const WrapIndex &wrap_index);
+  bool IsAtLastRow(const WrapIndex &wrap_index) const;
+
+  // Scroll as little as possible to have the whole line on screen, or at
+  // least its beginning if it takes more rows than the screen has
+  void ShowLine(size_t line, const WrapIndex &wrap_index);
 
  private:
   unsigned int width_;
@@ -31,6 +52,11 @@ class State {
                     // to check if we can go up
   unsigned int visible_lines_;
 
+  bool wrapping_ = false;
+  unsigned int start_row_ = 0;
+
+  void GotoRow(uint64_t row, const WrapIndex &wrap_index);
+  uint64_t GetFirstRow(const WrapIndex &wrap_index) const;
   void RecalculateVisibleLines();
 };
 
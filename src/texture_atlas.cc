@@ -1,10 +1,25 @@
 // Copyright 2019 <Andrea Cognolato>
 #include "./texture_atlas.h"
 
+#include <algorithm>
+#include <cstring>
+
 namespace texture_atlas {
 static GLsizei kTextureDepth = 1024;
 static GLsizei kMipLevelCount = 1;
 
+static size_t BytesPerPixel(GLenum format) {
+  switch (format) {
+    case GL_RED:
+      return 1;
+    case GL_RGB:
+    case GL_BGR:
+      return 3;
+    default:
+      return 4;
+  }
+}
+
 TextureAtlas::TextureAtlas(GLsizei textureWidth, GLsizei textureHeight,
                            GLuint shaderProgramId,
                            const char* textureUniformLocation,
@@ -13,8 +28,12 @@ TextureAtlas::TextureAtlas(GLsizei textureWidth, GLsizei textureHeight,
     : textureWidth_(textureWidth),
       textureHeight_(textureHeight),
       texture_cache_(kTextureDepth),
-      format_(format) {
+      format_(format),
+      texture_unit_(shader_texture_index) {
+  // Each atlas has a texture unit of its own, where its texture stays bound,
+  // so neither uploads nor draws need to bind it again
   glGenTextures(1, &texture_);
+  glActiveTexture(GL_TEXTURE0 + texture_unit_);
   glBindTexture(GL_TEXTURE_2D_ARRAY, texture_);
   glTexStorage3D(GL_TEXTURE_2D_ARRAY, kMipLevelCount, internalformat,
                  textureWidth_, textureHeight_, kTextureDepth);
@@ -22,26 +41,41 @@ TextureAtlas::TextureAtlas(GLsizei textureWidth, GLsizei textureHeight,
   glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 
   glUniform1i(glGetUniformLocation(shaderProgramId, textureUniformLocation),
               shader_texture_index);
 }
 TextureAtlas::~TextureAtlas() { glDeleteTextures(1, &texture_); }
 
-void TextureAtlas::Insert(const vector<unsigned char>& bitmap_buffer,
-                          GLsizei width, GLsizei height, Character* ch,
+void TextureAtlas::Insert(const RenderedGlyph& glyph, Character* ch,
                           GLuint offset) {
   assert(static_cast<GLsizei>(offset) < kTextureDepth);
 
-  GLint level = 0, xoffset = 0, yoffset = 0;
-  GLsizei depth = 1;
+  GLsizei width = glyph.character.size.x, height = glyph.character.size.y;
+
+  // Copy the glyph a row at a time, to skip the padding at the end of
+  // FreeType's rows. A blank column and row after it go up too, so that
+  // filtering at its edges doesn't pick up what was in the layer before
+  size_t pixel_size = BytesPerPixel(format_);
+  GLsizei columns = std::min(width, textureWidth_);
+  GLsizei rows = std::min(height, textureHeight_);
+  GLsizei staged_width = std::min(columns + 1, textureWidth_);
+  GLsizei staged_height = std::min(rows + 1, textureHeight_);
+  size_t row_size = columns * pixel_size;
+  size_t staged_row_size = staged_width * pixel_size;
+
+  // For bottom-up bitmaps the buffer starts with the last row
+  const unsigned char* row = glyph.buffer;
+  if (glyph.pitch < 0 && height > 0) {
+    row -= static_cast<ptrdiff_t>(height - 1) * glyph.pitch;
+  }
 
-  glBindTexture(GL_TEXTURE_2D_ARRAY, texture_);
-  glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, xoffset, yoffset, offset, width,
-                  height, depth, format_, GL_UNSIGNED_BYTE,
-                  bitmap_buffer.data());
-  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  size_t slot = staging_.size();
+  staging_.resize(slot + staged_row_size * staged_height, 0);
+  for (GLsizei i = 0; i < rows; i++, row += glyph.pitch) {
+    memcpy(staging_.data() + slot + i * staged_row_size, row, row_size);
+  }
+  staged_glyphs_.push_back({offset, staged_width, staged_height, slot});
 
   auto v = glm::vec2(width / static_cast<GLfloat>(textureWidth_),
                      height / static_cast<GLfloat>(textureHeight_));
@@ -50,24 +84,42 @@ void TextureAtlas::Insert(const vector<unsigned char>& bitmap_buffer,
   ch->texture_coordinates = v;
 }
 
-void TextureAtlas::Append(std::pair<Character, vector<unsigned char>>* p,
-                          hb_codepoint_t codepoint) {
-  Insert(p->second, p->first.size.x, p->first.size.y, &p->first, index_++);
+void TextureAtlas::Commit() {
+  if (staged_glyphs_.empty()) return;
+
+  glActiveTexture(GL_TEXTURE0 + texture_unit_);
+
+  // Glyphs are far smaller than a layer, so uploading each one's rectangle
+  // moves a fraction of the bytes whole layers would
+  for (const staged_glyph_t& glyph : staged_glyphs_) {
+    GLint level = 0, xoffset = 0, yoffset = 0;
+    GLsizei depth = 1;
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, xoffset, yoffset, glyph.layer,
+                    glyph.width, glyph.height, depth, format_,
+                    GL_UNSIGNED_BYTE, staging_.data() + glyph.offset);
+  }
+
+  staging_.clear();
+  staged_glyphs_.clear();
+}
+
+void TextureAtlas::Append(RenderedGlyph* glyph, hb_codepoint_t codepoint) {
+  Insert(*glyph, &glyph->character, index_++);
 
   auto& item = texture_cache_[codepoint];
-  item.character = p->first;
+  item.character = glyph->character;
   item.fresh = true;
 }
 
-void TextureAtlas::Replace(std::pair<Character, vector<unsigned char>>* p,
-                           hb_codepoint_t stale, hb_codepoint_t codepoint) {
-  Insert(p->second, p->first.size.x, p->first.size.y, &p->first,
+void TextureAtlas::Replace(RenderedGlyph* glyph, hb_codepoint_t stale,
+                           hb_codepoint_t codepoint) {
+  Insert(*glyph, &glyph->character,
          texture_cache_[stale].character.texture_array_index);
 
   texture_cache_.erase(stale);
 
   auto& item = texture_cache_[codepoint];
-  item.character = p->first;
+  item.character = glyph->character;
   item.fresh = true;
 }
 
@@ -84,8 +136,7 @@ Character* TextureAtlas::Get(hb_codepoint_t codepoint) {
   return nullptr;
 }
 
-void TextureAtlas::Insert(hb_codepoint_t codepoint,
-                          pair<Character, vector<unsigned char>>* ch) {
+void TextureAtlas::Insert(hb_codepoint_t codepoint, RenderedGlyph* ch) {
   assert(!IsFull() || Contains_stale());
 
   if (!IsFull()) {
@@ -13,13 +13,11 @@
 #include <glad/glad.h>
 
 #include <unordered_map>
-#include <utility>
 #include <vector>
 
 #include <glm/glm.hpp>
 
 namespace texture_atlas {
-using std::pair;
 using std::unordered_map;
 using std::vector;
 
@@ -35,6 +33,17 @@ struct Character {
   bool colored;
 };
 
+// A glyph rendered by FreeType, which points into the glyph slot of its face
+// and so is only valid until the next glyph of that face is loaded
+struct RenderedGlyph {
+  Character character;
+  const unsigned char* buffer;
+  // Bytes from the start of a row to the start of the next one, which can be
+  // more than the row's pixels take, and is negative for bitmaps stored
+  // bottom-up
+  int pitch;
+};
+
 class TextureAtlas {
  private:
   typedef struct {
@@ -48,6 +57,23 @@ class TextureAtlas {
 
   unordered_map<hb_codepoint_t, cache_element_t> texture_cache_;
   GLenum format_;
+  // The texture stays bound to this unit
+  GLint texture_unit_;
+
+  // A glyph inserted since the last Commit, which goes in the top left
+  // corner of a layer. Its rows are packed in staging_ from offset on.
+  // These aren't in the frame arena: Commit clears them but they keep their
+  // capacity, so they only allocate until they can hold the most glyphs a
+  // frame brings in, and frames which bring in none don't use them at all
+  typedef struct {
+    GLuint layer;
+    GLsizei width;
+    GLsizei height;
+    size_t offset;
+  } staged_glyph_t;
+
+  vector<unsigned char> staging_;
+  vector<staged_glyph_t> staged_glyphs_;
 
  public:
   TextureAtlas(GLsizei textureWidth, GLsizei textureHeight,
@@ -57,23 +83,21 @@ class TextureAtlas {
 
   ~TextureAtlas();
 
-  void Insert(const vector<unsigned char>& bitmap_buffer, GLsizei width,
-              GLsizei height, Character* ch, GLuint offset);
+  void Insert(const RenderedGlyph& glyph, Character* ch, GLuint offset);
+
+  // Upload the glyphs inserted since the last call, only the rectangles they
+  // take. Must be done before drawing them
+  void Commit();
 
-  void Append(pair<Character, vector<unsigned char>>* p,
-              hb_codepoint_t codepoint);
+  void Append(RenderedGlyph* glyph, hb_codepoint_t codepoint);
 
-  void Replace(pair<Character, vector<unsigned char>>* p, hb_codepoint_t stale,
+  void Replace(RenderedGlyph* glyph, hb_codepoint_t stale,
                hb_codepoint_t codepoint);
 
   bool Contains(hb_codepoint_t codepoint) const;
 
   Character* Get(hb_codepoint_t codepoint);
-  void Insert(hb_codepoint_t codepoint,
-              pair<Character, vector<unsigned char>>* ch);
-
-  pair<Character, vector<unsigned char>> RenderGlyph(FT_Face face,
-                                                     hb_codepoint_t codepoint);
+  void Insert(hb_codepoint_t codepoint, RenderedGlyph* glyph);
 
   bool IsFull() const;
 
@@ -0,0 +1,411 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./trigram_index.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+namespace trigram_index {
+
+// Trigrams are three bytes
+static const size_t kTrigrams = 1 << 24;
+static const size_t kFirstBlockLines = 16;
+// Past this the index doesn't rule out enough to be worth its memory
+static const size_t kMaxBlockLines = 64 << 10;
+// How long to wait for the document to be indexed
+static const std::chrono::milliseconds kIndexingPollInterval(10);
+static const char kMagic[8] = {'L', 'T', 'R', 'I', 'G', 'R', 'M', '1'};
+
+// The beginning of the saved index, followed by the lists
+typedef struct {
+  char magic[8];
+  uint64_t file_size;
+  int64_t file_mtime_sec;
+  int64_t file_mtime_nsec;
+  uint64_t block_lines;
+  uint64_t line_count;
+  uint64_t postings;
+} header_t;
+
+// 7 bits at a time, the lowest first, with the high bit set on all of the
+// bytes but the last
+static void AppendVarint(uint32_t value, vector<uint8_t> *bytes) {
+  while (value >= 0x80) {
+    bytes->push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  bytes->push_back(static_cast<uint8_t>(value));
+}
+
+static uint32_t Trigram(const char *text) {
+  return static_cast<uint32_t>(static_cast<unsigned char>(text[0])) << 16 |
+         static_cast<uint32_t>(static_cast<unsigned char>(text[1])) << 8 |
+         static_cast<uint32_t>(static_cast<unsigned char>(text[2]));
+}
+
+TrigramIndex::TrigramIndex(const Document *document, const string &path,
+                           size_t memory_budget, function<void()> on_ready)
+    : document_(document),
+      path_(path),
+      index_path_(path + ".trigrams"),
+      memory_budget_(memory_budget),
+      on_ready_(on_ready) {}
+
+TrigramIndex::~TrigramIndex() { Cancel(); }
+
+void TrigramIndex::Start() {
+  Cancel();
+
+  ready_ = false;
+  started_ = true;
+  interrupted_ = false;
+  paused_ = false;
+  finished_ = false;
+  build_started_ = false;
+  revision_ = document_->GetRevision();
+
+  if (!StatFile()) return;
+  indexing_thread_ = thread(&TrigramIndex::Index, this);
+}
+
+void TrigramIndex::Cancel() {
+  Pause();
+  interrupted_ = interrupted_ || paused_;
+  paused_ = false;
+}
+
+void TrigramIndex::Pause() {
+  if (!indexing_thread_.joinable()) return;
+
+  stop_ = true;
+  indexing_thread_.join();
+  stop_ = false;
+  paused_ = !finished_;
+}
+
+void TrigramIndex::Resume() {
+  if (!paused_) return;
+
+  // Appended lines don't change the revision, anything else does
+  if (document_->GetRevision() != revision_) {
+    Start();
+    return;
+  }
+
+  // The index is saved for the file as it is now, with the lines appended
+  paused_ = false;
+  if (!StatFile()) return;
+  indexing_thread_ = thread(&TrigramIndex::Index, this);
+}
+
+bool TrigramIndex::StatFile() {
+  struct stat file_stat;
+  if (stat(path_.c_str(), &file_stat) == -1) return false;
+  file_size_ = file_stat.st_size;
+  file_mtime_sec_ = file_stat.st_mtim.tv_sec;
+  file_mtime_nsec_ = file_stat.st_mtim.tv_nsec;
+  return true;
+}
+
+bool TrigramIndex::IsReady() const { return ready_; }
+
+bool TrigramIndex::IsOutOfDate() const {
+  return started_ && (interrupted_ || revision_ != document_->GetRevision());
+}
+
+uint64_t TrigramIndex::GetRevision() const { return revision_; }
+
+size_t TrigramIndex::LineCount() const { return line_count_; }
+
+size_t TrigramIndex::GetBlockLines() const { return block_lines_; }
+
+trigram_index_stats_t TrigramIndex::GetStats() const {
+  return trigram_index_stats_t{postings_.size(), posting_bytes_, block_lines_,
+                               loaded_};
+}
+
+void TrigramIndex::Index() {
+  // The lines have to be all there
+  while (!document_->IsIndexed()) {
+    if (stop_) return;
+    std::this_thread::sleep_for(kIndexingPollInterval);
+  }
+
+  // A paused build carries on instead of starting over
+  loaded_ = !build_started_ && Load();
+  if (!loaded_ && !Build()) {
+    // Over its budget, there's nothing to carry on with
+    finished_ = !stop_;
+    return;
+  }
+  finished_ = true;
+
+  // Edited while it was being built, it's of no use
+  if (document_->GetRevision() != revision_) return;
+  if (!loaded_) Save();
+
+  ready_ = true;
+  if (on_ready_) on_ready_();
+}
+
+bool TrigramIndex::Build() {
+  if (!build_started_) {
+    trigram_postings_.assign(kTrigrams, 0);
+    postings_.clear();
+    posting_bytes_ = 0;
+    block_lines_ = kFirstBlockLines;
+    next_line_ = 0;
+    build_started_ = true;
+  }
+
+  // A last line without a line terminator might still grow
+  string buffer;
+  size_t lines = document_->LineCount();
+  if (lines > 0) {
+    string_view last = document_->GetLines(lines - 1, 1, &buffer);
+    if (last.empty() || last.back() != '\n') lines--;
+  }
+
+  vector<uint32_t> trigrams;
+  for (size_t line = next_line_; line < lines;) {
+    if (stop_) {
+      next_line_ = line;
+      return false;
+    }
+
+    // After the blocks get bigger a block can be added in two goes
+    auto block = static_cast<uint32_t>(line / block_lines_);
+    size_t end = std::min((block + 1) * block_lines_, lines);
+    string_view text = document_->GetLines(line, end - line, &buffer);
+    line = end;
+
+    // What is searched for doesn't span lines
+    trigrams.clear();
+    for (size_t i = 0; i + 2 < text.size(); i++) {
+      if (text[i + 1] == '\n' || text[i + 2] == '\n') continue;
+      trigrams.push_back(Trigram(text.data() + i));
+    }
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()),
+                   trigrams.end());
+    for (uint32_t trigram : trigrams) {
+      Add(trigram, block);
+    }
+
+    if (MemoryUsage() > memory_budget_) {
+      if (block_lines_ >= kMaxBlockLines) {
+        fprintf(stderr, "Trigram index over its budget: %s\n",
+                path_.c_str());
+        return false;
+      }
+      Coarsen();
+    }
+  }
+
+  line_count_ = lines;
+  return true;
+}
+
+void TrigramIndex::Add(uint32_t trigram, uint32_t block) {
+  uint32_t &index = trigram_postings_[trigram];
+  if (index == 0) {
+    postings_.push_back(posting_t{trigram, 0, 0, vector<uint8_t>()});
+    index = postings_.size();
+  }
+
+  posting_t &posting = postings_[index - 1];
+  if (posting.count > 0 && posting.last == block) return;
+
+  size_t size = posting.bytes.size();
+  AppendVarint(posting.count == 0 ? block : block - posting.last,
+               &posting.bytes);
+  posting_bytes_ += posting.bytes.size() - size;
+  posting.last = block;
+  posting.count++;
+}
+
+size_t TrigramIndex::MemoryUsage() const {
+  return trigram_postings_.size() * sizeof(trigram_postings_[0]) +
+         postings_.size() * sizeof(postings_[0]) + posting_bytes_;
+}
+
+void TrigramIndex::Coarsen() {
+  block_lines_ *= 2;
+  posting_bytes_ = 0;
+
+  for (auto &posting : postings_) {
+    vector<uint32_t> blocks = Decode(posting);
+    posting.bytes.clear();
+    posting.count = 0;
+    for (uint32_t block : blocks) {
+      block /= 2;
+      if (posting.count > 0 && posting.last == block) continue;
+      AppendVarint(posting.count == 0 ? block : block - posting.last,
+                   &posting.bytes);
+      posting.last = block;
+      posting.count++;
+    }
+    posting.bytes.shrink_to_fit();
+    posting_bytes_ += posting.bytes.size();
+  }
+}
+
+vector<uint32_t> TrigramIndex::Decode(const posting_t &posting) const {
+  vector<uint32_t> blocks;
+  blocks.reserve(posting.count);
+
+  uint32_t block = 0, value = 0;
+  int shift = 0;
+  for (uint8_t byte : posting.bytes) {
+    value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+    if (byte & 0x80) {
+      shift += 7;
+      continue;
+    }
+    block = blocks.empty() ? value : block + value;
+    blocks.push_back(block);
+    value = 0;
+    shift = 0;
+  }
+  return blocks;
+}
+
+bool TrigramIndex::FindCandidates(string_view text,
+                                  vector<uint32_t> *blocks) const {
+  if (text.size() < 3) return false;
+
+  vector<uint32_t> trigrams;
+  for (size_t i = 0; i + 2 < text.size(); i++) {
+    trigrams.push_back(Trigram(text.data() + i));
+  }
+  std::sort(trigrams.begin(), trigrams.end());
+  trigrams.erase(std::unique(trigrams.begin(), trigrams.end()),
+                 trigrams.end());
+
+  // A trigram which is nowhere rules out everything
+  vector<const posting_t *> lists;
+  for (uint32_t trigram : trigrams) {
+    if (trigram_postings_[trigram] == 0) return true;
+    lists.push_back(&postings_[trigram_postings_[trigram] - 1]);
+  }
+
+  // Starting from the shortest list keeps the intersections short
+  std::sort(lists.begin(), lists.end(),
+            [](const posting_t *a, const posting_t *b) {
+              return a->count < b->count;
+            });
+  vector<uint32_t> candidates = Decode(*lists[0]), intersection;
+  for (size_t i = 1; i < lists.size() && !candidates.empty(); i++) {
+    vector<uint32_t> list = Decode(*lists[i]);
+    intersection.clear();
+    std::set_intersection(candidates.begin(), candidates.end(), list.begin(),
+                          list.end(), std::back_inserter(intersection));
+    candidates.swap(intersection);
+  }
+
+  blocks->insert(blocks->end(), candidates.begin(), candidates.end());
+  return true;
+}
+
+bool TrigramIndex::Load() {
+  FILE *file = fopen(index_path_.c_str(), "rb");
+  if (file == nullptr) return false;
+
+  // Sizes are checked against what's left of the file before anything is
+  // allocated, so that a truncated or corrupt file gets rebuilt instead
+  struct stat index_stat;
+  uint64_t left = fstat(fileno(file), &index_stat) == 0
+                      ? static_cast<uint64_t>(index_stat.st_size)
+                      : 0;
+
+  // The file must be the one which was indexed, and still have all of the
+  // indexed lines
+  header_t header;
+  const uint64_t kFieldsSize = 4 * sizeof(uint32_t);
+  bool valid = left >= sizeof(header) &&
+               fread(&header, sizeof(header), 1, file) == 1 &&
+               memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+               header.file_size == static_cast<uint64_t>(file_size_) &&
+               header.file_mtime_sec == file_mtime_sec_ &&
+               header.file_mtime_nsec == file_mtime_nsec_ &&
+               header.line_count <= document_->LineCount() &&
+               header.block_lines >= kFirstBlockLines &&
+               header.block_lines <= kMaxBlockLines &&
+               header.postings <= kTrigrams &&
+               header.postings <= (left - sizeof(header)) / kFieldsSize;
+  if (valid) left -= sizeof(header) + header.postings * kFieldsSize;
+
+  trigram_postings_.assign(kTrigrams, 0);
+  postings_.clear();
+  posting_bytes_ = 0;
+  for (uint64_t i = 0; valid && i < header.postings; i++) {
+    if (stop_) {
+      valid = false;
+      break;
+    }
+
+    uint32_t fields[4];
+    valid = fread(fields, sizeof(fields), 1, file) == 1 &&
+            fields[0] < kTrigrams && trigram_postings_[fields[0]] == 0 &&
+            fields[3] <= left && fields[2] <= fields[3];
+    if (!valid) break;
+    left -= fields[3];
+
+    posting_t posting = {fields[0], fields[1], fields[2],
+                         vector<uint8_t>(fields[3])};
+    valid = fread(posting.bytes.data(), 1, fields[3], file) == fields[3];
+    posting_bytes_ += fields[3];
+    postings_.push_back(std::move(posting));
+    trigram_postings_[fields[0]] = postings_.size();
+  }
+  fclose(file);
+  valid = valid && left == 0;
+
+  if (!valid) return false;
+  block_lines_ = header.block_lines;
+  line_count_ = header.line_count;
+  return true;
+}
+
+void TrigramIndex::Save() const {
+  // Write next to where it goes and then move it there, like
+  // Document::Save
+  string temp_path = index_path_ + ".tmp";
+  FILE *file = fopen(temp_path.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Could not write trigram index: %s\n",
+            temp_path.c_str());
+    return;
+  }
+
+  header_t header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.file_size = file_size_;
+  header.file_mtime_sec = file_mtime_sec_;
+  header.file_mtime_nsec = file_mtime_nsec_;
+  header.block_lines = block_lines_;
+  header.line_count = line_count_;
+  header.postings = postings_.size();
+
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (auto &posting : postings_) {
+    uint32_t fields[4] = {posting.trigram, posting.last, posting.count,
+                          static_cast<uint32_t>(posting.bytes.size())};
+    written = written && fwrite(fields, sizeof(fields), 1, file) == 1 &&
+              fwrite(posting.bytes.data(), 1, posting.bytes.size(), file) ==
+                  posting.bytes.size();
+  }
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temp_path.c_str(), index_path_.c_str()) == -1) {
+    fprintf(stderr, "Could not save trigram index: %s\n",
+            index_path_.c_str());
+    unlink(temp_path.c_str());
+  }
+}
+
+}  // namespace trigram_index
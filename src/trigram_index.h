@@ -0,0 +1,141 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_TRIGRAM_INDEX_H_
+#define SRC_TRIGRAM_INDEX_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "./document.h"
+
+namespace trigram_index {
+using document::Document;
+using std::atomic;
+using std::function;
+using std::string;
+using std::string_view;
+using std::thread;
+using std::vector;
+
+typedef struct {
+  size_t trigrams;
+  size_t posting_bytes;
+  size_t block_lines;
+  bool loaded;
+} trigram_index_stats_t;
+
+// Which blocks of lines of the document have each sequence of three bytes.
+// Any text of three bytes or more can only be in the blocks which have all of
+// its trigrams, so searches only need to look at those. The blocks start
+// small and get bigger, merging the lists, when the index would use more
+// than its memory budget.
+// The lists are of increasing block numbers, each stored as the difference
+// from the one before in as few bytes as it takes.
+// The index is built in the background and saved next to the file, where the
+// next time the file is opened it's loaded from, unless the file changed
+// size or modification time since. Like Search it reads the document, so it
+// must be cancelled, or paused, before the document is refreshed.
+class TrigramIndex {
+ public:
+  // on_ready is called from the indexing thread when the index is ready
+  TrigramIndex(const Document *document, const string &path,
+               size_t memory_budget, function<void()> on_ready);
+  ~TrigramIndex();
+
+  // Load the saved index, or build it and save it
+  void Start();
+  // Stop building, an index which isn't ready yet is thrown away
+  void Cancel();
+  // Stop building but keep what was built, for when lines are about to be
+  // appended to the document. Resume carries on from there, or starts over
+  // if the document was replaced or edited meanwhile
+  void Pause();
+  void Resume();
+
+  bool IsReady() const;
+  // Returns true if the index was started and is not for the document as it
+  // is now anymore
+  bool IsOutOfDate() const;
+  // The revision of the document which was indexed, see
+  // Document::GetRevision
+  uint64_t GetRevision() const;
+  // Returns how many lines were indexed, from the first
+  size_t LineCount() const;
+  size_t GetBlockLines() const;
+  trigram_index_stats_t GetStats() const;
+
+  // Append to blocks, in order, the blocks of lines which might contain the
+  // text. Returns false if the text is too short to rule any block out. The
+  // index must be ready
+  bool FindCandidates(string_view text, vector<uint32_t> *blocks) const;
+
+  // Disable copy
+  TrigramIndex(const TrigramIndex &) = delete;
+  // Disable move
+  TrigramIndex &operator=(const TrigramIndex &) = delete;
+
+ private:
+  typedef struct {
+    uint32_t trigram;
+    // The last block in the list, which the next one is stored relative to
+    uint32_t last;
+    uint32_t count;
+    vector<uint8_t> bytes;
+  } posting_t;
+
+  const Document *document_;
+  string path_;
+  string index_path_;
+  size_t memory_budget_;
+  function<void()> on_ready_;
+
+  // Only touched by the indexing thread until the index is ready
+  // Index in postings_ + 1 of each of the 2^24 trigrams, 0 when it has none
+  vector<uint32_t> trigram_postings_;
+  vector<posting_t> postings_;
+  size_t posting_bytes_ = 0;
+  size_t block_lines_ = 0;
+  size_t line_count_ = 0;
+  // Where Build carries on from after a pause
+  bool build_started_ = false;
+  size_t next_line_ = 0;
+  bool loaded_ = false;
+  // What the file looked like when it was indexed
+  off_t file_size_ = 0;
+  int64_t file_mtime_sec_ = 0;
+  int64_t file_mtime_nsec_ = 0;
+
+  bool started_ = false;
+  // Cancelled before it was ready
+  bool interrupted_ = false;
+  bool paused_ = false;
+  // The indexing thread is done, whether the index is ready or not
+  bool finished_ = false;
+  uint64_t revision_ = 0;
+  atomic<bool> ready_{false};
+  atomic<bool> stop_{false};
+  thread indexing_thread_;
+
+  void Index();
+  // Remember what the file looks like, returns false if it isn't there
+  bool StatFile();
+  bool Build();
+  void Add(uint32_t trigram, uint32_t block);
+  size_t MemoryUsage() const;
+  // Make the blocks twice as big, which about halves the lists
+  void Coarsen();
+  bool Load();
+  void Save() const;
+  vector<uint32_t> Decode(const posting_t &posting) const;
+};
+
+}  // namespace trigram_index
+
+#endif  // SRC_TRIGRAM_INDEX_H_
@@ -15,7 +15,8 @@ class Window {
   GLFWwindow* window;
 
   Window(int width, int height, const string& title, GLFWkeyfun keyCallback,
-         GLFWscrollfun scrollCallback, GLFWframebuffersizefun resizeCallback) {
+         GLFWcharfun charCallback, GLFWscrollfun scrollCallback,
+         GLFWframebuffersizefun resizeCallback) {
     glfwInit();  // Init GLFW
 
     // Require OpenGL >= 4.6
@@ -29,6 +30,7 @@ class Window {
     window = glfwCreateWindow(width, height, title.c_str(), nullptr, nullptr);
 
     glfwSetKeyCallback(window, keyCallback);
+    glfwSetCharCallback(window, charCallback);
     glfwSetScrollCallback(window, scrollCallback);
     glfwSetFramebufferSizeCallback(window, resizeCallback);
 
@@ -0,0 +1,260 @@
+// Copyright 2019 <Andrea Cognolato>
+#include "./wrap_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace wrap_index {
+
+// Lines are added to chunks of this many lines, chunks which get twice as
+// long are split
+static const size_t kChunkLines = 512;
+
+static size_t LowBit(size_t i) { return i & (~i + 1); }
+
+// Returns the sum of the first `count` values of a Fenwick tree
+static uint64_t Prefix(const vector<uint64_t> &tree, size_t count) {
+  uint64_t sum = 0;
+  for (size_t i = count; i > 0; i -= LowBit(i)) {
+    sum += tree[i];
+  }
+  return sum;
+}
+
+static void Add(vector<uint64_t> *tree, size_t index, int64_t delta) {
+  for (size_t i = index + 1; i < tree->size(); i += LowBit(i)) {
+    (*tree)[i] += delta;
+  }
+}
+
+// Returns how many of the first values of a Fenwick tree add up to at most
+// `value`, and takes them off of it
+static size_t Find(const vector<uint64_t> &tree, uint64_t *value) {
+  size_t size = tree.size() - 1;
+  size_t count = 0;
+  size_t step = 1;
+  while (step * 2 <= size) step *= 2;
+
+  for (; step > 0; step /= 2) {
+    if (count + step <= size && tree[count + step] <= *value) {
+      count += step;
+      *value -= tree[count];
+    }
+  }
+  return count;
+}
+
+WrapIndex::WrapIndex() : line_tree_(1, 0), row_tree_(1, 0) {}
+
+void WrapIndex::Reset(size_t lines) {
+  Clear();
+  Resize(lines);
+}
+
+void WrapIndex::Resize(size_t lines) {
+  // The document was reloaded and got shorter
+  if (lines < lines_) {
+    Reset(lines);
+    return;
+  }
+
+  // Fill up the last chunk, and then add new ones
+  size_t chunks = chunks_.size();
+  while (lines_ < lines) {
+    if (chunks_.empty() || chunks_.back().rows.size() >= kChunkLines) {
+      chunks_.push_back(chunk_t{{}, {}, 0});
+    }
+    chunk_t &chunk = chunks_.back();
+    size_t count = std::min(lines - lines_, kChunkLines - chunk.rows.size());
+    chunk.rows.resize(chunk.rows.size() + count, 1);
+    chunk.measured.resize(chunk.measured.size() + count, 0);
+    lines_ += count;
+
+    if (chunks_.size() == chunks) {
+      AddToChunk(chunks - 1, count, count);
+    } else {
+      chunk.row_count += count;
+    }
+  }
+
+  if (chunks_.size() != chunks) Rebuild();
+}
+
+void WrapIndex::Splice(size_t line, size_t removed, size_t added) {
+  assert(line + removed <= LineCount());
+  bool rebuild = false;
+
+  // The removed lines might span a few chunks
+  while (removed > 0) {
+    pair<size_t, size_t> position = Locate(line);
+    chunk_t &chunk = chunks_[position.first];
+    size_t count = std::min(removed, chunk.rows.size() - position.second);
+
+    auto rows = chunk.rows.begin() + position.second;
+    uint64_t row_count = 0;
+    for (auto it = rows; it != rows + count; it++) row_count += *it;
+    chunk.rows.erase(rows, rows + count);
+    auto measured = chunk.measured.begin() + position.second;
+    chunk.measured.erase(measured, measured + count);
+
+    AddToChunk(position.first, -static_cast<int64_t>(count),
+               -static_cast<int64_t>(row_count));
+    lines_ -= count;
+    removed -= count;
+    rebuild = rebuild || chunk.rows.empty();
+  }
+
+  if (added > 0) {
+    if (chunks_.empty()) {
+      chunks_.push_back(chunk_t{{}, {}, 0});
+      line_tree_.assign(2, 0);
+      row_tree_.assign(2, 0);
+    }
+    // Lines added at the end go in the last chunk
+    pair<size_t, size_t> position = Locate(line);
+    if (position.first == chunks_.size()) {
+      position = {chunks_.size() - 1, chunks_.back().rows.size()};
+    }
+
+    chunk_t &chunk = chunks_[position.first];
+    chunk.rows.insert(chunk.rows.begin() + position.second, added, 1);
+    chunk.measured.insert(chunk.measured.begin() + position.second, added,
+                          0);
+    AddToChunk(position.first, added, added);
+    lines_ += added;
+    rebuild = rebuild || chunk.rows.size() > 2 * kChunkLines;
+  }
+
+  if (rebuild) Rebuild();
+}
+
+void WrapIndex::Clear() {
+  chunks_.clear();
+  chunks_.shrink_to_fit();
+  line_tree_.assign(1, 0);
+  line_tree_.shrink_to_fit();
+  row_tree_.assign(1, 0);
+  row_tree_.shrink_to_fit();
+  lines_ = 0;
+}
+
+bool WrapIndex::SetWidth(unsigned int width) {
+  if (width == width_) return false;
+
+  width_ = width;
+  generation_++;
+  return true;
+}
+
+unsigned int WrapIndex::GetWidth() const { return width_; }
+
+void WrapIndex::Invalidate() { generation_++; }
+
+bool WrapIndex::IsMeasured(size_t line) const {
+  pair<size_t, size_t> position = Locate(line);
+  return chunks_[position.first].measured[position.second] == generation_;
+}
+
+unsigned int WrapIndex::GetRows(size_t line) const {
+  pair<size_t, size_t> position = Locate(line);
+  return chunks_[position.first].rows[position.second];
+}
+
+void WrapIndex::SetRows(size_t line, unsigned int rows) {
+  assert(rows > 0);
+  pair<size_t, size_t> position = Locate(line);
+  chunk_t &chunk = chunks_[position.first];
+  chunk.measured[position.second] = generation_;
+
+  int64_t delta = static_cast<int64_t>(rows) - chunk.rows[position.second];
+  chunk.rows[position.second] = rows;
+  if (delta == 0) return;
+
+  AddToChunk(position.first, 0, delta);
+}
+
+size_t WrapIndex::LineCount() const { return lines_; }
+
+uint64_t WrapIndex::RowCount() const {
+  return Prefix(row_tree_, chunks_.size());
+}
+
+uint64_t WrapIndex::RowOf(size_t line) const {
+  pair<size_t, size_t> position = Locate(line);
+  uint64_t row = Prefix(row_tree_, position.first);
+  for (size_t i = 0; i < position.second; i++) {
+    row += chunks_[position.first].rows[i];
+  }
+  return row;
+}
+
+pair<size_t, unsigned int> WrapIndex::LineAt(uint64_t row) const {
+  // Find the chunk, and then the line in it
+  size_t chunk = Find(row_tree_, &row);
+  size_t line = Prefix(line_tree_, chunk);
+
+  // Past the end of the document
+  if (chunk == chunks_.size()) {
+    return {line, 0};
+  }
+
+  for (unsigned int rows : chunks_[chunk].rows) {
+    if (row < rows) break;
+    row -= rows;
+    line++;
+  }
+  return {line, static_cast<unsigned int>(row)};
+}
+
+pair<size_t, size_t> WrapIndex::Locate(size_t line) const {
+  uint64_t offset = line;
+  size_t chunk = Find(line_tree_, &offset);
+  return {chunk, offset};
+}
+
+void WrapIndex::AddToChunk(size_t chunk, int64_t lines, int64_t rows) {
+  chunks_[chunk].row_count += rows;
+  Add(&line_tree_, chunk, lines);
+  Add(&row_tree_, chunk, rows);
+}
+
+void WrapIndex::Rebuild() {
+  vector<chunk_t> chunks;
+  chunks.reserve(chunks_.size());
+  for (chunk_t &chunk : chunks_) {
+    if (chunk.rows.empty()) continue;
+    if (chunk.rows.size() <= 2 * kChunkLines) {
+      chunks.push_back(std::move(chunk));
+      continue;
+    }
+
+    for (size_t i = 0; i < chunk.rows.size(); i += kChunkLines) {
+      size_t end = std::min(i + kChunkLines, chunk.rows.size());
+      chunk_t part = {
+          vector<unsigned int>(chunk.rows.begin() + i,
+                               chunk.rows.begin() + end),
+          vector<uint32_t>(chunk.measured.begin() + i,
+                           chunk.measured.begin() + end),
+          0};
+      for (unsigned int rows : part.rows) part.row_count += rows;
+      chunks.push_back(std::move(part));
+    }
+  }
+  chunks_.swap(chunks);
+
+  // The linear time construction of a Fenwick tree, where every node adds
+  // itself to its parent
+  size_t size = chunks_.size();
+  line_tree_.assign(size + 1, 0);
+  row_tree_.assign(size + 1, 0);
+  for (size_t i = 1; i <= size; i++) {
+    line_tree_[i] += chunks_[i - 1].rows.size();
+    row_tree_[i] += chunks_[i - 1].row_count;
+    if (i + LowBit(i) <= size) {
+      line_tree_[i + LowBit(i)] += line_tree_[i];
+      row_tree_[i + LowBit(i)] += row_tree_[i];
+    }
+  }
+}
+
+}  // namespace wrap_index
@@ -0,0 +1,83 @@
+// Copyright 2019 <Andrea Cognolato>
+#ifndef SRC_WRAP_INDEX_H_
+#define SRC_WRAP_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace wrap_index {
+using std::pair;
+using std::vector;
+
+// Maps the visual rows of a soft wrapped document to lines and back.
+// The lines are kept in chunks of a few hundred, with Fenwick trees over how
+// many lines and rows each chunk has, so both directions are O(log n) plus a
+// scan of a chunk. Lines are added and removed inside of their chunk, only
+// when chunks are split or emptied the trees are built again. Lines count as
+// a single row until they are measured, which only happens around the
+// viewport. When the width changes the old counts are kept as estimates
+// until each line is measured again.
+class WrapIndex {
+ public:
+  WrapIndex();
+
+  // Start over with `lines` lines, each counted as a single row
+  void Reset(size_t lines);
+  // Follow a growing document, new lines count as a single row
+  void Resize(size_t lines);
+  // Drop everything, for when wrapping is turned off
+  void Clear();
+  // Follow an edit which replaced `removed` lines starting at `line` with
+  // `added` new ones. The new lines count as a single row until measured,
+  // the others keep their measurements
+  void Splice(size_t line, size_t removed, size_t added);
+
+  // Returns true if the width changed, making every measurement stale
+  bool SetWidth(unsigned int width);
+  unsigned int GetWidth() const;
+  // Mark every measurement as stale, for when the lines may have changed
+  void Invalidate();
+
+  bool IsMeasured(size_t line) const;
+  unsigned int GetRows(size_t line) const;
+  void SetRows(size_t line, unsigned int rows);
+
+  size_t LineCount() const;
+  // Returns the total number of rows
+  uint64_t RowCount() const;
+  // Returns the first row of the line
+  uint64_t RowOf(size_t line) const;
+  // Returns the line the row belongs to and which of its rows it is
+  pair<size_t, unsigned int> LineAt(uint64_t row) const;
+
+ private:
+  typedef struct {
+    vector<unsigned int> rows;
+    // The generation of the width each line was measured at
+    vector<uint32_t> measured;
+    uint64_t row_count;
+  } chunk_t;
+
+  vector<chunk_t> chunks_;
+  // 1-based, tree_[i] holds the lines or the rows of the chunks
+  // (i - lowbit(i), i]
+  vector<uint64_t> line_tree_;
+  vector<uint64_t> row_tree_;
+  size_t lines_ = 0;
+  uint32_t generation_ = 1;
+  unsigned int width_ = 0;
+
+  // Returns the chunk the line is in and where in it
+  pair<size_t, size_t> Locate(size_t line) const;
+  // Count lines and rows added to the chunk, or removed if negative
+  void AddToChunk(size_t chunk, int64_t lines, int64_t rows);
+  // Split chunks which got too long, drop the empty ones and build the
+  // trees again
+  void Rebuild();
+};
+
+}  // namespace wrap_index
+
+#endif  // SRC_WRAP_INDEX_H_